@@ -41,9 +41,21 @@ namespace jit
 
 bool enabled = false;
 bool debug = false;
+bool tiered = false;
+unsigned tier_threshold = 100;
+unsigned compile_threads = 2;
+std::string cache_path = "";
+unsigned code_cache_size = 256;
 
 } // namespace jit
 
+namespace interpreter
+{
+
+bool threaded = false;
+
+} // namespace interpreter
+
 namespace system
 {
 
@@ -55,6 +67,7 @@ std::string platform = "sdl";
 #error No UI backend selected!
 #endif
 std::string system_path = "/undefined_system_path";
+bool virtual_time = false;
 
 } // namespace system
 
@@ -169,7 +182,22 @@ struct CerealJit
    {
       using namespace jit;
       ar(CEREAL_NVP(enabled),
-         CEREAL_NVP(debug));
+         CEREAL_NVP(debug),
+         CEREAL_NVP(tiered),
+         CEREAL_NVP(tier_threshold),
+         CEREAL_NVP(compile_threads),
+         CEREAL_NVP(cache_path),
+         CEREAL_NVP(code_cache_size));
+   }
+};
+
+struct CerealInterpreter
+{
+   template <class Archive>
+   void serialize(Archive &ar)
+   {
+      using namespace interpreter;
+      ar(CEREAL_NVP(threaded));
    }
 };
 
@@ -180,7 +208,8 @@ struct CerealSystem
    {
       using namespace system;
       ar(CEREAL_NVP(system_path),
-         CEREAL_NVP(platform));
+         CEREAL_NVP(platform),
+         CEREAL_NVP(virtual_time));
    }
 };
 
@@ -255,6 +284,7 @@ bool load(const std::string &path)
             cereal::make_nvp("gx2", CerealGX2 {}),
             cereal::make_nvp("log", CerealLog {}),
             cereal::make_nvp("jit", CerealJit {}),
+            cereal::make_nvp("interpreter", CerealInterpreter {}),
             cereal::make_nvp("system", CerealSystem {}),
             cereal::make_nvp("input", CerealInput {}),
             cereal::make_nvp("ui", CerealUi {}));
@@ -275,6 +305,7 @@ void save(const std::string &path)
           cereal::make_nvp("gx2", CerealGX2 {}),
           cereal::make_nvp("log", CerealLog {}),
           cereal::make_nvp("jit", CerealJit {}),
+          cereal::make_nvp("interpreter", CerealInterpreter {}),
           cereal::make_nvp("system", CerealSystem {}),
           cereal::make_nvp("input", CerealInput {}),
           cereal::make_nvp("ui", CerealUi {}));
@@ -35,14 +35,27 @@ namespace jit
 
 extern bool enabled;
 extern bool debug;
+extern bool tiered;
+extern unsigned tier_threshold;
+extern unsigned compile_threads;
+extern std::string cache_path;
+extern unsigned code_cache_size;
 
 } // namespace jit
 
+namespace interpreter
+{
+
+extern bool threaded;
+
+} // namespace interpreter
+
 namespace system
 {
 
 extern std::string platform;
 extern std::string system_path;
+extern bool virtual_time;
 
 } // namespace system
 
@@ -12,6 +12,12 @@ namespace cpu
 interrupt_handler
 gInterruptHandler;
 
+idle_handler
+gIdleHandler;
+
+bool
+gVirtualTime = false;
+
 JitMode
 gJitMode = JitMode::Disabled;
 
@@ -23,8 +29,14 @@ void setJitMode(JitMode mode)
    gJitMode = mode;
 }
 
+JitMode getJitMode()
+{
+   return gJitMode;
+}
+
 void initialise()
 {
+   initialiseTimeBase();
    gInstructionTable.initialise();
    cpu::interpreter::initialise();
    cpu::jit::initialise();
@@ -35,6 +47,11 @@ void set_interrupt_handler(interrupt_handler handler)
    gInterruptHandler = handler;
 }
 
+void set_idle_handler(idle_handler handler)
+{
+   gIdleHandler = handler;
+}
+
 void interrupt(CoreState *core)
 {
    core->interrupt.exchange(true);
@@ -50,6 +67,40 @@ void clearInterrupt(CoreState *core)
    core->interrupt.exchange(false);
 }
 
+void setVirtualTime(bool enabled)
+{
+   gVirtualTime = enabled;
+}
+
+bool isVirtualTime()
+{
+   return gVirtualTime;
+}
+
+void setVirtualDeadline(CoreState *core, uint64_t time)
+{
+   core->virtualDeadline.store(time, std::memory_order_relaxed);
+
+   if (core->virtualTime.load(std::memory_order_relaxed) >= time) {
+      core->virtualDeadline.store(UINT64_MAX, std::memory_order_relaxed);
+      core->interrupt.store(true);
+   }
+}
+
+void
+invalidateInstructionCache(uint32_t address, uint32_t size)
+{
+   cpu::interpreter::invalidate(address, size);
+   cpu::jit::invalidate(address, size);
+}
+
+void
+invalidateModifiedCode()
+{
+   cpu::interpreter::invalidateModified();
+   cpu::jit::invalidateModified();
+}
+
 void
 setRoundingMode(ThreadState *state)
 {
@@ -69,6 +120,10 @@ void executeSub(CoreState *core, ThreadState *state)
 
    if (gJitMode == JitMode::Enabled) {
       jit::executeSub(state);
+   } else if (gJitMode == JitMode::Tiered) {
+      jit::executeSubTiered(state);
+   } else if (gJitMode == JitMode::Threaded) {
+      interpreter::executeSubThreaded(state);
    } else {
       interpreter::executeSub(state);
    }
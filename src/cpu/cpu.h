@@ -1,6 +1,7 @@
 #pragma once
 #include <cstdint>
 #include <atomic>
+#include <chrono>
 #include <functional>
 #include <utility>
 #include "ppcinvoke.h"
@@ -16,23 +17,58 @@ struct CoreState;
 enum class JitMode {
    Enabled,
    Disabled,
-   Debug
+   Debug,
+   Tiered,
+   Threaded
 };
 
 static const uint32_t CALLBACK_ADDR = 0xFBADCDE0;
 
 void initialise();
 void setJitMode(JitMode mode);
+JitMode getJitMode();
 
 typedef void(*interrupt_handler)(CoreState*, ThreadState*);
 void set_interrupt_handler(interrupt_handler handler);
 
+// Called when the guest thread is spinning in an idle loop
+typedef void(*idle_handler)(CoreState*, ThreadState*);
+void set_idle_handler(idle_handler handler);
+
 void interrupt(CoreState *core);
 bool hasInterrupt(CoreState *core);
 void clearInterrupt(CoreState *core);
 
+// Virtual time, the guest clock of each core is the number of instructions
+//   it has run instead of host time, must be set before initialise.
+void setVirtualTime(bool enabled);
+bool isVirtualTime();
+
+// Raise an interrupt on core once its virtual time reaches time
+void setVirtualDeadline(CoreState *core, uint64_t time);
+
+// The time base counts at a quarter of the 248.625MHz bus clock
+static const uint64_t TimeBaseFrequency = 62156250;
+
+// True when the time base is read from an invariant host TSC
+bool hasTscTimeBase();
+
+// Time base ticks since initialise, follows the core's clock in virtual
+//   time mode.
+uint64_t getTimeBase(CoreState *core);
+
+// Host wall clock from the same source as the time base, cheaper to read
+//   than std::chrono::system_clock when the TSC is used.
+std::chrono::system_clock::time_point getHostTime();
+
 void setRoundingMode(ThreadState *state);
 
+// Guest code in the given range may have changed
+void invalidateInstructionCache(uint32_t address, uint32_t size);
+
+// Guest code anywhere may have changed
+void invalidateModifiedCode();
+
 void executeSub(CoreState *core, ThreadState *state);
 
 using KernelCallFn = void(*)(ThreadState *state, void *userData);
@@ -0,0 +1,147 @@
+#include "cpu_internal.h"
+#include "instructiondata.h"
+#include "mem/mem.h"
+#include "utils/bitutils.h"
+
+namespace cpu
+{
+
+static const uint32_t MaxIdleLoopLength = 8;
+
+/*
+An idle loop polls memory until another core or an interrupt changes it:
+
+   loop: lwz r3, 0(r31)
+         cmpwi r3, 0
+         beq loop
+
+The body may only load, compare and do simple arithmetic on what it
+loaded, and must not carry a GPR value from one iteration to the next.
+Every iteration then computes the same result until memory changes, so
+pausing the core in the middle of it loses nothing.
+*/
+static bool
+isIdleInstruction(InstructionID id)
+{
+   switch (id) {
+   case InstructionID::lbz:
+   case InstructionID::lbzx:
+   case InstructionID::lha:
+   case InstructionID::lhax:
+   case InstructionID::lhz:
+   case InstructionID::lhzx:
+   case InstructionID::lwz:
+   case InstructionID::lwzx:
+   case InstructionID::lhbrx:
+   case InstructionID::lwbrx:
+   case InstructionID::lwarx:
+   case InstructionID::cmp:
+   case InstructionID::cmpi:
+   case InstructionID::cmpl:
+   case InstructionID::cmpli:
+   case InstructionID::andi:
+   case InstructionID::rlwinm:
+   case InstructionID::or_:
+   case InstructionID::ori:
+   case InstructionID::extsb:
+   case InstructionID::extsh:
+   case InstructionID::sync:
+   case InstructionID::isync:
+   case InstructionID::eieio:
+      return true;
+   default:
+      return false;
+   }
+}
+
+static uint32_t
+getGprMask(Instruction instr, const std::vector<Field>& fields)
+{
+   uint32_t mask = 0;
+
+   for (auto field : fields) {
+      switch (field) {
+      case Field::rA:
+         mask |= 1u << instr.rA;
+         break;
+      case Field::rB:
+         mask |= 1u << instr.rB;
+         break;
+      case Field::rD:
+         mask |= 1u << instr.rD;
+         break;
+      case Field::rS:
+         mask |= 1u << instr.rS;
+         break;
+      default:
+         break;
+      }
+   }
+
+   return mask;
+}
+
+// Returns true if the branch at end jumps back to start and everything
+//   in between is an idle loop as described above.
+bool
+isIdleLoop(uint32_t start, uint32_t end)
+{
+   if (end < start || (end - start) / 4 >= MaxIdleLoopLength) {
+      return false;
+   }
+
+   auto branch = mem::read<Instruction>(end);
+   auto data = gInstructionTable.decode(branch);
+   uint32_t target;
+
+   if (!data) {
+      return false;
+   } else if (data->id == InstructionID::b) {
+      target = end + sign_extend<26>(branch.li << 2);
+   } else if (data->id == InstructionID::bc) {
+      // Loops counting down ctr end by themselves
+      if (!get_bit<2>(branch.bo)) {
+         return false;
+      }
+
+      target = end + sign_extend<16>(branch.bd << 2);
+   } else {
+      return false;
+   }
+
+   if (branch.aa || branch.lk || target != start) {
+      return false;
+   }
+
+   uint32_t loopWrites = 0;
+
+   for (auto addr = start; addr < end; addr += 4) {
+      auto instr = mem::read<Instruction>(addr);
+      data = gInstructionTable.decode(instr);
+
+      if (!data || !isIdleInstruction(data->id)) {
+         return false;
+      }
+
+      loopWrites |= getGprMask(instr, data->write);
+   }
+
+   uint32_t written = 0;
+
+   for (auto addr = start; addr < end; addr += 4) {
+      auto instr = mem::read<Instruction>(addr);
+      data = gInstructionTable.decode(instr);
+
+      // Reading a register before this iteration writes it sees the
+      //   value from the previous iteration.
+      if (getGprMask(instr, data->read) & loopWrites & ~written) {
+         return false;
+      }
+
+      written |= getGprMask(instr, data->write);
+   }
+
+   return true;
+}
+
+} // namespace cpu
@@ -1,9 +1,47 @@
 #pragma once
+#include <chrono>
 #include "cpu.h"
 
 namespace cpu
 {
 
 extern interrupt_handler gInterruptHandler;
+extern idle_handler gIdleHandler;
+extern bool gVirtualTime;
+
+// Count instructions run by core in virtual time mode, raises the
+//   interrupt once it reaches its deadline.
+inline void
+advanceVirtualTime(CoreState *core, uint64_t count)
+{
+   auto time = core->virtualTime.load(std::memory_order_relaxed) + count;
+   core->virtualTime.store(time, std::memory_order_relaxed);
+
+   if (time >= core->virtualDeadline.load(std::memory_order_relaxed)) {
+      core->virtualDeadline.store(UINT64_MAX, std::memory_order_relaxed);
+      core->interrupt.store(true);
+   }
+}
+
+bool isIdleLoop(uint32_t start, uint32_t end);
+
+/*
+The host TSC scaled to the guest time base. Generated code for mftb reads
+origin and tickScale directly, so they may only change in
+initialiseTimeBase. Scales are 32.32 fixed point.
+*/
+struct TimeBase
+{
+   uint64_t origin = 0;       // TSC when the time base started
+   uint64_t tickScale = 0;    // Time base ticks per TSC tick
+   uint64_t nsScale = 0;      // Nanoseconds per TSC tick
+   bool useTsc = false;
+   std::chrono::system_clock::time_point hostStart;
+   std::chrono::steady_clock::time_point steadyStart;
+};
+
+extern TimeBase gTimeBase;
+
+void initialiseTimeBase();
 
 }
\ No newline at end of file
@@ -0,0 +1,135 @@
+#include <chrono>
+#include <thread>
+#include "cpu.h"
+#include "cpu_internal.h"
+#include "platform/platform.h"
+#include "utils/log.h"
+
+#ifdef PLATFORM_WINDOWS
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+
+namespace cpu
+{
+
+// The core clock runs at exactly 20 times the time base
+static const uint64_t CoreClockPerTimeBase = 20;
+
+// How long to count TSC ticks for against the host steady clock
+static const auto CalibrationTime = std::chrono::milliseconds { 50 };
+
+TimeBase
+gTimeBase;
+
+static bool
+hasInvariantTsc()
+{
+#ifdef PLATFORM_WINDOWS
+   int regs[4];
+   __cpuid(regs, 0x80000000);
+
+   if (static_cast<uint32_t>(regs[0]) < 0x80000007) {
+      return false;
+   }
+
+   __cpuid(regs, 0x80000007);
+   return !!(regs[3] & (1 << 8));
+#else
+   unsigned eax, ebx, ecx, edx;
+
+   if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx)) {
+      return false;
+   }
+
+   return !!(edx & (1 << 8));
+#endif
+}
+
+// (delta * scale) >> 32, the same sequence generated code uses for mftb
+static inline uint64_t
+scaleTsc(uint64_t delta, uint64_t scale)
+{
+#ifdef PLATFORM_WINDOWS
+   uint64_t high;
+   auto low = _umul128(delta, scale, &high);
+   return (high << 32) | (low >> 32);
+#else
+   return static_cast<uint64_t>((static_cast<unsigned __int128>(delta) * scale) >> 32);
+#endif
+}
+
+/*
+The time base starts counting when the CPU is initialised. With an invariant
+TSC it is read with rdtsc and scaled by a multiplier measured here against
+the host steady clock, otherwise every read goes through std::chrono.
+*/
+void
+initialiseTimeBase()
+{
+   gTimeBase.useTsc = hasInvariantTsc();
+
+   if (gTimeBase.useTsc) {
+      auto steadyStart = std::chrono::steady_clock::now();
+      auto tscStart = __rdtsc();
+      std::this_thread::sleep_for(CalibrationTime);
+      auto tscEnd = __rdtsc();
+      auto steadyEnd = std::chrono::steady_clock::now();
+
+      auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(steadyEnd - steadyStart).count();
+      auto tscPerNs = static_cast<double>(tscEnd - tscStart) / static_cast<double>(ns);
+
+      if (tscPerNs > 0.0) {
+         gTimeBase.tickScale = static_cast<uint64_t>((TimeBaseFrequency / 1e9) / tscPerNs * 4294967296.0);
+         gTimeBase.nsScale = static_cast<uint64_t>(1.0 / tscPerNs * 4294967296.0);
+         gLog->info("Using invariant TSC for the time base, {:.0f} MHz", tscPerNs * 1000.0);
+      } else {
+         gTimeBase.useTsc = false;
+      }
+   }
+
+   if (!gTimeBase.useTsc) {
+      gLog->info("Host has no invariant TSC, time base uses the system clock");
+   }
+
+   gTimeBase.hostStart = std::chrono::system_clock::now();
+   gTimeBase.steadyStart = std::chrono::steady_clock::now();
+   gTimeBase.origin = __rdtsc();
+}
+
+bool
+hasTscTimeBase()
+{
+   return gTimeBase.useTsc;
+}
+
+uint64_t
+getTimeBase(CoreState *core)
+{
+   if (gVirtualTime) {
+      return core ? core->virtualTime.load(std::memory_order_relaxed) / CoreClockPerTimeBase : 0;
+   }
+
+   if (gTimeBase.useTsc) {
+      return scaleTsc(__rdtsc() - gTimeBase.origin, gTimeBase.tickScale);
+   }
+
+   auto elapsed = std::chrono::steady_clock::now() - gTimeBase.steadyStart;
+   uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+   return (ns / 1000000000) * TimeBaseFrequency + (ns % 1000000000) * TimeBaseFrequency / 1000000000;
+}
+
+std::chrono::system_clock::time_point
+getHostTime()
+{
+   if (!gTimeBase.useTsc) {
+      return std::chrono::system_clock::now();
+   }
+
+   auto ns = std::chrono::nanoseconds { scaleTsc(__rdtsc() - gTimeBase.origin, gTimeBase.nsScale) };
+   return gTimeBase.hostStart + std::chrono::duration_cast<std::chrono::system_clock::duration>(ns);
+}
+
+} // namespace cpu
@@ -69,6 +69,7 @@ struct InstructionTable
    void initialise();
    InstructionData *find(InstructionID instrId);
    InstructionData *decode(Instruction instr);
+   InstructionData *decodeTree(Instruction instr);
    Instruction encode(InstructionID id);
    InstructionAlias *findAlias(InstructionData *data, Instruction instr);
    bool isA(InstructionID id, Instruction instr);
@@ -55,9 +55,30 @@ struct TableEntry
    std::vector<FieldMap> fieldMaps;
 };
 
+/*
+Flattened form of instructionTable used by decode, indexed by primary
+opcode and then by the bits covered by the secondary opcode fields of
+that primary opcode. Anything which also depends on bits outside of
+those is marked SlowDecode and walks instructionTable instead.
+*/
+struct PrimaryEntry
+{
+   bool leaf = false;
+   InstructionData *instr = nullptr;
+   uint32_t shift = 0;
+   uint32_t mask = 0;
+   std::vector<InstructionData *> secondary;
+};
+
+static const uint32_t MaxSecondaryBits = 12;
+
+static InstructionData * const
+SlowDecode = reinterpret_cast<InstructionData *>(static_cast<uintptr_t>(-1));
+
 static std::vector<InstructionData> instructionData;
 static std::vector<InstructionAlias> aliasData;
 static TableEntry instructionTable;
+static PrimaryEntry primaryTable[64];
 
 static void
 initData();
@@ -65,6 +86,9 @@ initData();
 static void
 initTable();
 
+static void
+initFlatTable();
+
 #define FLD(x, y, z, ...) {y, z},
 #define MRKR(x, ...) {-1, -1},
 static BitRange gFieldBits[] = {
@@ -137,14 +161,19 @@ InstructionTable::find(InstructionID instrId)
    return &instructionData[static_cast<size_t>(instrId)];
 }
 
-// Decode Instruction to InstructionData
-InstructionData *
-InstructionTable::decode(Instruction instr)
+// Walk the decode tree from table, returns false if that would need any
+//   instruction bits outside of keyMask.
+static bool
+walkTable(TableEntry *table, Instruction instr, uint32_t keyMask, InstructionData *&result)
 {
-   TableEntry *table = &instructionTable;
+   result = nullptr;
 
    while (table) {
       for (auto &fieldMap : table->fieldMaps) {
+         if (getFieldBitmask(fieldMap.field) & ~keyMask) {
+            return false;
+         }
+
          auto value = getFieldValue(fieldMap.field, instr);
          table = &fieldMap.children[value];
 
@@ -154,11 +183,42 @@ InstructionTable::decode(Instruction instr)
       }
 
       if (table->fieldMaps.size() == 0) {
-         return table->instr;
+         result = table->instr;
+         return true;
       }
    }
 
-   return nullptr;
+   return true;
+}
+
+// Decode Instruction to InstructionData
+InstructionData *
+InstructionTable::decode(Instruction instr)
+{
+   auto &primary = primaryTable[instr.opcd];
+
+   if (primary.leaf) {
+      return primary.instr;
+   }
+
+   if (!primary.secondary.empty()) {
+      auto data = primary.secondary[(instr.value >> primary.shift) & primary.mask];
+
+      if (data != SlowDecode) {
+         return data;
+      }
+   }
+
+   return decodeTree(instr);
+}
+
+// Decode by walking the full decode tree, decode must always agree with it
+InstructionData *
+InstructionTable::decodeTree(Instruction instr)
+{
+   InstructionData *result;
+   walkTable(&instructionTable, instr, 0xFFFFFFFF, result);
+   return result;
 }
 
 InstructionAlias *
@@ -227,6 +287,7 @@ InstructionTable::initialise()
 {
    initData();
    initTable();
+   initFlatTable();
 }
 
 // Initialise instructionTable
@@ -252,6 +313,55 @@ initTable()
    }
 }
 
+// Initialise primaryTable from instructionTable
+void
+initFlatTable()
+{
+   auto opcdMap = instructionTable.getFieldMap(Field::opcd);
+   assert(opcdMap);
+
+   for (auto opcd = 0u; opcd < 64; ++opcd) {
+      auto &primary = primaryTable[opcd];
+      auto table = &opcdMap->children[opcd];
+
+      if (table->fieldMaps.empty()) {
+         primary.leaf = true;
+         primary.instr = table->instr;
+         continue;
+      }
+
+      // The secondary index covers every bit used by the next level
+      auto start = 31u;
+      auto end = 0u;
+
+      for (auto &fieldMap : table->fieldMaps) {
+         start = std::min(start, getFieldStart(fieldMap.field));
+         end = std::max(end, getFieldEnd(fieldMap.field));
+      }
+
+      auto width = end - start + 1;
+
+      if (width > MaxSecondaryBits) {
+         continue;
+      }
+
+      primary.shift = start;
+      primary.mask = (1u << width) - 1;
+      primary.secondary.resize(primary.mask + 1);
+
+      auto keyMask = primary.mask << start;
+
+      for (auto i = 0u; i <= primary.mask; ++i) {
+         auto instr = Instruction { (opcd << getFieldStart(Field::opcd)) | (i << start) };
+         auto &data = primary.secondary[i];
+
+         if (!walkTable(table, instr, keyMask, data)) {
+            data = SlowDecode;
+         }
+      }
+   }
+}
+
 std::string cleanInsName(const std::string& name)
 {
    if (name[name.size() - 1] == '_') {
@@ -1,3 +1,4 @@
+#include <atomic>
 #include "interpreter.h"
 #include "interpreter_insreg.h"
 #include "../instructiondata.h"
@@ -17,6 +18,33 @@ namespace interpreter
 static std::vector<instrfptr_t>
 sInstructionMap;
 
+/*
+Cache of decoded instructions, one page of entries for each 4KiB page of
+guest code. An entry packs the instruction word with its InstructionID so
+it can be read and written atomically by any core. It is only used when
+the instruction word in memory still matches, so modified code is simply
+decoded again.
+*/
+static const unsigned DecodePageShift = 12;
+static const size_t DecodePageCount = size_t { 1 } << (32 - DecodePageShift);
+static const size_t DecodePageEntries = size_t { 1 } << (DecodePageShift - 2);
+static const uint64_t DecodeEntryValid = 1ull << 63;
+
+struct DecodePage
+{
+   DecodePage()
+   {
+      for (auto &entry : entries) {
+         entry.store(0, std::memory_order_relaxed);
+      }
+   }
+
+   std::atomic<uint64_t> entries[DecodePageEntries];
+};
+
+static std::atomic<DecodePage *>
+sDecodePages[DecodePageCount];
+
 void initialise()
 {
    sInstructionMap.resize(static_cast<size_t>(InstructionID::InstructionCount), nullptr);
@@ -52,37 +80,83 @@ bool hasInstruction(InstructionID instrId)
    return getInstructionHandler(instrId) != nullptr;
 }
 
-void execute(ThreadState *state)
+// Decode instr at address, using the decode cache where possible
+static InstructionData *
+decode(uint32_t address, Instruction instr)
 {
-   while (state->nia != cpu::CALLBACK_ADDR) {
-      if (state->core->interrupt.load()) {
-         cpu::gInterruptHandler(state->core, state);
+   auto &pagePtr = sDecodePages[address >> DecodePageShift];
+   auto page = pagePtr.load(std::memory_order_acquire);
+
+   if (!page) {
+      auto newPage = new DecodePage();
+
+      if (pagePtr.compare_exchange_strong(page, newPage)) {
+         page = newPage;
+      } else {
+         delete newPage;
       }
+   }
 
-      // Interpreter Loop!
-      state->cia = state->nia;
-      state->nia = state->cia + 4;
+   auto &entry = page->entries[(address & ((1u << DecodePageShift) - 1)) >> 2];
+   auto value = entry.load(std::memory_order_relaxed);
 
-      gDebugControl.maybeBreak(state->cia, state, gProcessor.getCoreID());
+   if ((value & DecodeEntryValid) && static_cast<uint32_t>(value) == instr.value) {
+      return gInstructionTable.find(static_cast<InstructionID>((value >> 32) & 0xFFFF));
+   }
 
-      auto instr = mem::read<Instruction>(state->cia);
-      auto data = gInstructionTable.decode(instr);
+   auto data = gInstructionTable.decode(instr);
 
-      if (!data) {
-         gLog->error("Could not decode instruction at {:08x} = {:08x}", state->cia, instr.value);
-      }
-      assert(data);
+   if (data) {
+      value = DecodeEntryValid;
+      value |= static_cast<uint64_t>(data->id) << 32;
+      value |= instr.value;
+      entry.store(value, std::memory_order_relaxed);
+   }
 
-      auto trace = traceInstructionStart(instr, data, state);
-      auto fptr = sInstructionMap[static_cast<size_t>(data->id)];
+   return data;
+}
 
-      if (!fptr) {
-         gLog->error("Unimplemented interpreter instruction {}", data->name);
-      }
-      assert(fptr);
+// Execute the single instruction at state->nia
+void step(ThreadState *state)
+{
+   if (cpu::gVirtualTime) {
+      cpu::advanceVirtualTime(state->core, 1);
+   }
+
+   if (state->core->interrupt.load()) {
+      cpu::gInterruptHandler(state->core, state);
+   }
+
+   // Interpreter Loop!
+   state->cia = state->nia;
+   state->nia = state->cia + 4;
+
+   gDebugControl.maybeBreak(state->cia, state, gProcessor.getCoreID());
+
+   auto instr = mem::read<Instruction>(state->cia);
+   auto data = decode(state->cia, instr);
+
+   if (!data) {
+      gLog->error("Could not decode instruction at {:08x} = {:08x}", state->cia, instr.value);
+   }
+   assert(data);
 
-      fptr(state, instr);
-      traceInstructionEnd(trace, instr, data, state);
+   auto trace = traceInstructionStart(instr, data, state);
+   auto fptr = sInstructionMap[static_cast<size_t>(data->id)];
+
+   if (!fptr) {
+      gLog->error("Unimplemented interpreter instruction {}", data->name);
+   }
+   assert(fptr);
+
+   fptr(state, instr);
+   traceInstructionEnd(trace, instr, data, state);
+}
+
+void execute(ThreadState *state)
+{
+   while (state->nia != cpu::CALLBACK_ADDR) {
+      step(state);
    }
 }
 
@@ -8,7 +8,13 @@ namespace interpreter
 
 void initialise();
 
+void step(ThreadState *state);
 void executeSub(ThreadState *state);
 
+// Threaded interpreter, runs pre-decoded blocks of guest code
+void executeSubThreaded(ThreadState *state);
+void invalidate(uint32_t address, uint32_t size);
+void invalidateModified();
+
 }
 }
\ No newline at end of file
@@ -1,9 +1,11 @@
 #include <algorithm>
+#include <atomic>
 #include <cmath>
 #include "interpreter_float.h"
 #include "interpreter_insreg.h"
 #include "mem/mem.h"
 #include "utils/bitutils.h"
+#include "utils/byte_swap.h"
 #include "utils/floatutils.h"
 
 // Load
@@ -109,7 +111,9 @@ loadGeneric(ThreadState *state, Instruction instr)
    if (flags & LoadReserve) {
       state->reserve = true;
       state->reserveAddress = ea;
-      state->reserveData = mem::read<uint32_t>(state->reserveAddress);
+
+      // Reserve the value we loaded, a second read could see a newer one
+      state->reserveData = static_cast<uint32_t>(d);
    }
 
    if (flags & LoadUpdate) {
@@ -420,20 +424,22 @@ storeGeneric(ThreadState *state, Instruction instr)
    if (flags & StoreConditional) {
       state->cr.cr0 = state->xer.so ? ConditionRegisterFlag::SummaryOverflow : 0;
 
-      if (state->reserve) {
-         state->reserve = false;
+      // The reserved word is checked and written with a single host
+      //   cmpxchg, so a write from another core in between fails the
+      //   store. A reservation for a different address always fails.
+      if (state->reserve && ea == state->reserveAddress) {
+         auto word = reinterpret_cast<std::atomic<uint32_t> *>(mem::translate(ea));
+         auto expected = byte_swap(state->reserveData);
+         auto value = byte_swap(static_cast<uint32_t>(state->gpr[instr.rS]));
 
-         if (mem::read<uint32_t>(state->reserveAddress) == state->reserveData) {
-            // Store is succesful, clear reserve bit and set CR0[EQ]
+         if (word->compare_exchange_strong(expected, value)) {
+            // Store is succesful, set CR0[EQ]
             state->cr.cr0 |= ConditionRegisterFlag::Equal;
-         } else {
-            // Reservation has been written by another process
-            return;
          }
-      } else {
-         // Reserve bit is not set, do not write.
-         return;
       }
+
+      state->reserve = false;
+      return;
    }
 
    if (flags & StoreFloatAsInteger) {
@@ -33,6 +33,17 @@ INS(ecowx, (rd), (ra, rb), (), (opcd == 31, xo1 == 438), "")
 static void
 icbi(ThreadState *state, Instruction instr)
 {
+   uint32_t addr;
+
+   if (instr.rA == 0) {
+      addr = 0;
+   } else {
+      addr = state->gpr[instr.rA];
+   }
+
+   addr += state->gpr[instr.rB];
+   addr = align_down(addr, 32);
+   cpu::invalidateInstructionCache(addr, 32);
 }
 
 // Data Cache Block Flush
@@ -206,14 +217,15 @@ static void
 mftb(ThreadState *state, Instruction instr)
 {
    auto tbr = decodeSPR(instr);
+   auto timeBase = cpu::getTimeBase(state->core);
    auto value = 0u;
 
    switch (tbr) {
    case SprEncoding::UTBL:
-      value = state->tbl;
+      value = static_cast<uint32_t>(timeBase);
       break;
    case SprEncoding::UTBU:
-      value = state->tbu;
+      value = static_cast<uint32_t>(timeBase >> 32);
       break;
    default:
       gLog->error("Invalid mftb TBR {}", static_cast<uint32_t>(tbr));
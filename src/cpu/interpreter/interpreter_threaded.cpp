@@ -0,0 +1,280 @@
+#include <atomic>
+#include <vector>
+#include "interpreter.h"
+#include "interpreter_insreg.h"
+#include "../instructiondata.h"
+#include "../cpu_internal.h"
+#include "debugcontrol.h"
+#include "debugger.h"
+#include "mem/mem.h"
+#include "processor.h"
+
+namespace cpu
+{
+
+namespace interpreter
+{
+
+/*
+Threaded interpreter, guest code is translated once into blocks of
+pre-decoded handler calls which end at the first branch. Interrupts and
+debugger pauses are only checked between blocks, so a block runs as a
+tight loop of indirect calls with no fetch or decode.
+*/
+static const uint32_t ThreadedMaxBlockSize = 64;
+
+struct ThreadedOp
+{
+   instrfptr_t fptr;
+   Instruction instr;
+};
+
+struct ThreadedBlock
+{
+   uint32_t start;
+   uint32_t end;
+   bool idle;     // Block is an idle loop branching back to its start
+   std::vector<ThreadedOp> ops;
+};
+
+static const unsigned ThreadedPageShift = 12;
+static const size_t ThreadedPageCount = size_t { 1 } << (32 - ThreadedPageShift);
+static const size_t ThreadedPageEntries = size_t { 1 } << (ThreadedPageShift - 2);
+
+struct ThreadedPage
+{
+   ThreadedPage()
+   {
+      for (auto &block : blocks) {
+         block.store(nullptr, std::memory_order_relaxed);
+      }
+   }
+
+   std::atomic<ThreadedBlock *> blocks[ThreadedPageEntries];
+};
+
+static std::atomic<ThreadedPage *>
+sThreadedPages[ThreadedPageCount];
+
+static bool
+isBlockEnd(InstructionID id)
+{
+   switch (id) {
+   case InstructionID::b:
+   case InstructionID::bc:
+   case InstructionID::bcctr:
+   case InstructionID::bclr:
+   case InstructionID::kc:
+   case InstructionID::rfi:
+   case InstructionID::sc:
+      return true;
+   default:
+      return false;
+   }
+}
+
+static ThreadedBlock *
+translateBlock(uint32_t start)
+{
+   auto block = new ThreadedBlock();
+   block->start = start;
+   block->end = start;
+
+   while (block->ops.size() < ThreadedMaxBlockSize) {
+      auto instr = mem::read<Instruction>(block->end);
+      auto data = gInstructionTable.decode(instr);
+
+      if (!data) {
+         break;
+      }
+
+      auto fptr = getInstructionHandler(data->id);
+
+      if (!fptr) {
+         break;
+      }
+
+      block->ops.push_back(ThreadedOp { fptr, instr });
+      block->end += 4;
+
+      if (isBlockEnd(data->id)) {
+         break;
+      }
+   }
+
+   if (block->ops.empty()) {
+      // Leave it to step to report the bad instruction
+      delete block;
+      return nullptr;
+   }
+
+   block->idle = isIdleLoop(block->start, block->end - 4);
+   return block;
+}
+
+static std::atomic<ThreadedBlock *> &
+getBlockEntry(uint32_t address)
+{
+   auto &pagePtr = sThreadedPages[address >> ThreadedPageShift];
+   auto page = pagePtr.load(std::memory_order_acquire);
+
+   if (!page) {
+      auto newPage = new ThreadedPage();
+
+      if (pagePtr.compare_exchange_strong(page, newPage)) {
+         page = newPage;
+      } else {
+         delete newPage;
+      }
+   }
+
+   return page->blocks[(address & ((1u << ThreadedPageShift) - 1)) >> 2];
+}
+
+static ThreadedBlock *
+getBlock(uint32_t address)
+{
+   auto &entry = getBlockEntry(address);
+   auto block = entry.load(std::memory_order_acquire);
+
+   if (block) {
+      return block;
+   }
+
+   auto newBlock = translateBlock(address);
+
+   if (!newBlock) {
+      return nullptr;
+   }
+
+   if (entry.compare_exchange_strong(block, newBlock)) {
+      return newBlock;
+   }
+
+   // Another core translated it first
+   delete newBlock;
+   return block;
+}
+
+// Forget any blocks which overlap [address, address + size), a block may
+//   start up to ThreadedMaxBlockSize instructions before the range. Blocks
+//   are never freed as another core may still be running them.
+void invalidate(uint32_t address, uint32_t size)
+{
+   if (!size) {
+      return;
+   }
+
+   auto end = static_cast<uint64_t>(address) + size;
+   auto first = address & ~3u;
+   first = first > ThreadedMaxBlockSize * 4 ? first - ThreadedMaxBlockSize * 4 : 0;
+
+   for (auto addr = static_cast<uint64_t>(first); addr < end; addr += 4) {
+      auto page = sThreadedPages[addr >> ThreadedPageShift].load(std::memory_order_acquire);
+
+      if (!page) {
+         addr |= (1u << ThreadedPageShift) - 4;
+         continue;
+      }
+
+      auto &entry = page->blocks[(addr & ((1u << ThreadedPageShift) - 1)) >> 2];
+      auto block = entry.load(std::memory_order_acquire);
+
+      if (block && block->start < end && block->end > address) {
+         entry.compare_exchange_strong(block, nullptr);
+      }
+   }
+}
+
+// Forget any block whose guest code no longer matches what was translated
+void invalidateModified()
+{
+   for (auto &pagePtr : sThreadedPages) {
+      auto page = pagePtr.load(std::memory_order_acquire);
+
+      if (!page) {
+         continue;
+      }
+
+      for (auto &entry : page->blocks) {
+         auto block = entry.load(std::memory_order_acquire);
+
+         if (!block) {
+            continue;
+         }
+
+         for (auto i = 0u; i < block->ops.size(); ++i) {
+            if (mem::read<Instruction>(block->start + i * 4).value != block->ops[i].instr.value) {
+               entry.store(nullptr, std::memory_order_release);
+               break;
+            }
+         }
+      }
+   }
+}
+
+static void
+executeThreaded(ThreadState *state)
+{
+   while (state->nia != cpu::CALLBACK_ADDR) {
+      if (state->core->interrupt.load()) {
+         cpu::gInterruptHandler(state->core, state);
+      }
+
+      auto block = getBlock(state->nia);
+
+      if (!block) {
+         step(state);
+         continue;
+      }
+
+      if (gDebugger.isEnabled()) {
+         if (gDebugger.hasBreakpointInRange(block->start, block->end)) {
+            // Step through so every breakpoint is checked
+            do {
+               step(state);
+            } while (state->nia == state->cia + 4 && state->nia < block->end);
+
+            continue;
+         }
+
+         gDebugControl.maybeBreak(block->start, state, gProcessor.getCoreID());
+      }
+
+      auto cia = block->start;
+
+      for (auto &op : block->ops) {
+         state->cia = cia;
+         state->nia = cia + 4;
+         op.fptr(state, op.instr);
+
+         if (state->nia != cia + 4) {
+            break;
+         }
+
+         cia += 4;
+      }
+
+      if (cpu::gVirtualTime) {
+         cpu::advanceVirtualTime(state->core, (state->cia - block->start) / 4 + 1);
+      }
+
+      if (block->idle && state->nia == block->start && cpu::gIdleHandler) {
+         cpu::gIdleHandler(state->core, state);
+      }
+   }
+}
+
+void executeSubThreaded(ThreadState *state)
+{
+   auto lr = state->lr;
+   state->lr = CALLBACK_ADDR;
+
+   executeThreaded(state);
+
+   state->lr = lr;
+}
+
+} // namespace interpreter
+
+} // namespace cpu
@@ -1,9 +1,24 @@
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <unordered_set>
 #include <vector>
 #include "cpu/instructiondata.h"
 #include "jit.h"
+#include "jit_arena.h"
 #include "jit_internal.h"
 #include "jit_insreg.h"
+#include "jit_ir.h"
+#include "cpu/interpreter/interpreter.h"
+#include "debugcontrol.h"
+#include "debugger.h"
 #include "mem/mem.h"
+#include "platform/platform_thread.h"
+#include "processor.h"
+#include "utils/crc32.h"
 #include "utils/log.h"
 #include "utils/bitutils.h"
 
@@ -15,16 +30,117 @@ namespace jit
 
 static const bool JIT_DEBUG = true;
 static const int JIT_MAX_INST = 500;
+static const int JIT_MAX_CACHED_GPR = 4;
 
 static std::vector<jitinstrfptr_t>
 sInstructionMap;
 
 static asmjit::JitRuntime* sRuntime;
-static std::map<uint32_t, JitCode> sBlocks;
-static std::map<uint32_t, JitCode> sSingleBlocks;
+static JitCodeArena sArena;
+static size_t sCodeCacheSize = 256 * 1024 * 1024;
+static bool sArenaFull = false;
+static JitCodeTable sBlocks;
+static JitCodeTable sSingleBlocks;
+static std::map<uint32_t, std::vector<JitLink>> sLinks;
+
+// Only one thread may generate code or modify the tables at a time
+static std::mutex sMutex;
+
+// Marks an address which failed to compile so we do not retry it
+static JitCode const
+FailedBlock = reinterpret_cast<JitCode>(static_cast<uintptr_t>(-1));
 
 JitCall gCallFn;
 JitFinale gFinaleFn;
+std::atomic<uint32_t> gReturnStackEpoch { 1 };
+
+// Block entry counts for tiered execution, indexed by a hash of the
+//   address, a collision just promotes a block a little early.
+static const size_t TierCounterCount = 0x10000;
+static std::atomic<uint32_t> sTierCounters[TierCounterCount];
+static uint32_t sTierThreshold = 100;
+
+static std::atomic<uint64_t> sInterpretedBlocks { 0 };
+static std::atomic<uint64_t> sJitBlocks { 0 };
+static std::atomic<uint64_t> sCompiledBlocks { 0 };
+
+// Blocks waiting to be compiled by the background compile threads
+struct CompileRequest
+{
+   uint32_t addr;
+   bool gqrKnown;
+   uint32_t gqr[8];
+};
+
+static std::vector<std::thread> sCompileThreads;
+static std::deque<CompileRequest> sCompileQueue;
+static std::unordered_set<uint32_t> sCompileQueued;
+static std::mutex sCompileMutex;
+static std::condition_variable sCompileCondition;
+static bool sCompileRunning = false;
+
+/*
+Guest code pages which have compiled blocks are write protected, a write
+to one of them invalidates every block on that page. Pages which keep
+getting written to (code and data sharing a page) are left unprotected
+after a while and rely on icbi / OSCoherencyBarrier instead.
+
+The write fault handler runs in a signal handler, so it only unprotects
+the page and marks it dirty, the blocks on dirty pages are removed by the
+next thread to enter the dispatcher or the compiler.
+*/
+static const unsigned CodePageShift = 12;
+static const uint32_t CodePageSize = 1u << CodePageShift;
+static const uint8_t MaxPageInvalidations = 16;
+
+enum CodePageFlags : uint8_t
+{
+   PageProtected = 1 << 0,
+   PageTracked = 1 << 1,
+   PageUnprotecting = 1 << 2, // Write fault handler is unprotecting the page
+   PageDirty = 1 << 3,        // Written to since its blocks were compiled
+};
+
+struct CodePage
+{
+   std::atomic<uint8_t> flags;
+   uint8_t invalidations;
+};
+
+// Everything needed to remove a block again once its guest code changes
+//   or the arena region holding its code is reused.
+struct BlockInfo
+{
+   uint32_t start;
+   uint32_t end;
+   uint32_t crc;
+   uint8_t *code;
+   size_t codeSize;
+   uint32_t region;
+   std::vector<std::pair<uint32_t, JitCode>> entries;
+   std::vector<JitLink> links;
+};
+
+static std::unique_ptr<CodePage[]> sCodePages;
+static const size_t CodePageCount = size_t { 1 } << (32 - CodePageShift);
+static std::atomic<bool> sDirtyCodePages { false };
+static std::map<uint32_t, BlockInfo> sBlockInfo;
+static std::map<uint32_t, std::vector<uint32_t>> sPageBlocks;
+
+// Arena region holding the code of each single instruction block
+static std::map<uint32_t, uint32_t> sSingleBlockRegions;
+
+static void
+resetCodeTracking();
+
+static bool
+handleWriteFault(uint32_t address);
+
+static void
+processDirtyPages();
+
+static void
+retireRegion(uint32_t index);
 
 void initStubs()
 {
@@ -37,7 +153,11 @@ void initStubs()
    a.push(a.zbx);
    a.push(a.zdi);
    a.push(a.zsi);
+   a.push(a.zbp);
    a.push(asmjit::x86::r12);
+   a.push(asmjit::x86::r13);
+   a.push(asmjit::x86::r14);
+   a.push(asmjit::x86::r15);
    a.sub(a.zsp, 0x38);
    a.mov(a.zbx, a.zcx);
    a.mov(asmjit::x86::r12, a.zdx);
@@ -46,7 +166,11 @@ void initStubs()
 
    a.bind(extroLabel);
    a.add(a.zsp, 0x38);
+   a.pop(asmjit::x86::r15);
+   a.pop(asmjit::x86::r14);
+   a.pop(asmjit::x86::r13);
    a.pop(asmjit::x86::r12);
+   a.pop(a.zbp);
    a.pop(a.zsi);
    a.pop(a.zdi);
    a.pop(a.zbx);
@@ -57,11 +181,23 @@ void initStubs()
    gFinaleFn = asmjit_cast<JitCall>(basePtr, a.getLabelOffset(extroLabel));
 }
 
+void setCodeCacheSize(size_t size)
+{
+   sCodeCacheSize = size;
+}
+
 void initialise()
 {
    sRuntime = new asmjit::JitRuntime();
    initStubs();
 
+   if (!sArena.initialise(sCodeCacheSize)) {
+      gLog->error("Failed to allocate {} bytes for JIT code", sCodeCacheSize);
+   }
+
+   sCodePages.reset(new CodePage[CodePageCount]());
+   mem::setWriteFaultHandler(handleWriteFault);
+
    sInstructionMap.resize(static_cast<size_t>(InstructionID::InstructionCount), nullptr);
 
    // Register instruction handlers
@@ -104,17 +240,371 @@ bool hasInstruction(InstructionID instrId)
    }
 }
 
+// Other cores may still be running or looking up blocks, so every arena
+//   region is retired as if the arena had filled up and the tables keep
+//   their pages. Compile threads wait on sMutex meanwhile.
 void clearCache()
 {
-   if (sRuntime) {
-      delete sRuntime;
-      sRuntime = nullptr;
+   {
+      std::unique_lock<std::mutex> lock(sCompileMutex);
+      sCompileQueue.clear();
+      sCompileQueued.clear();
    }
 
-   sRuntime = new asmjit::JitRuntime();
-   sBlocks.clear();
-   sSingleBlocks.clear();
-   initStubs();
+   std::unique_lock<std::mutex> lock(sMutex);
+
+   for (auto i = 0u; i < JitCodeArena::RegionCount; ++i) {
+      auto &region = sArena.getRegion(i);
+
+      if (region.used && !region.retired) {
+         retireRegion(i);
+      }
+   }
+
+   sBlocks.reset();
+   sSingleBlocks.reset();
+   sSingleBlockRegions.clear();
+   sLinks.clear();
+   resetCodeTracking();
+   gReturnStackEpoch++;
+}
+
+// Emit a patchable exit from the current block to target
+void
+jit_exit(PPCEmuAssembler& a, uint32_t target)
+{
+   static const uint8_t jmpRel32[] = { 0xE9, 0x00, 0x00, 0x00, 0x00 };
+
+   JitExit exit;
+   exit.target = target;
+   exit.jump = asmjit::Label(a);
+   exit.stub = asmjit::Label(a);
+
+   // The target block loads whatever it caches from ThreadState
+   a.flushGprCache();
+
+   // Keep the rel32 4 byte aligned so it can be patched atomically
+   //   whilst another core might be executing it.
+   while ((a.getOffset() + 1) & 3) {
+      a.nop();
+   }
+
+   a.bind(exit.jump);
+   a.embed(jmpRel32, sizeof(jmpRel32));
+   a.exits.push_back(exit);
+}
+
+// Point the jmp rel32 at jump to target
+static bool
+patchJump(uint8_t *jump, const void *target)
+{
+   auto rel = reinterpret_cast<intptr_t>(target) - reinterpret_cast<intptr_t>(jump + 5);
+
+   if (rel < INT32_MIN || rel > INT32_MAX) {
+      return false;
+   }
+
+   *reinterpret_cast<volatile int32_t *>(jump + 1) = static_cast<int32_t>(rel);
+   return true;
+}
+
+// Register an exit, linking it straight away if the target is already compiled
+static void
+addLink(const JitLink &link)
+{
+   sLinks[link.target].push_back(link);
+
+   auto code = sBlocks.find(link.target);
+   if (code && code != FailedBlock) {
+      patchJump(link.jump, code);
+   }
+}
+
+// Link every exit waiting on addr to code
+static void
+linkTarget(uint32_t addr, JitCode code)
+{
+   auto i = sLinks.find(addr);
+   if (i == sLinks.end()) {
+      return;
+   }
+
+   for (auto &link : i->second) {
+      patchJump(link.jump, code);
+   }
+}
+
+static void
+protectCodePages(uint32_t start, uint32_t end)
+{
+   for (auto page = start >> CodePageShift; page <= (end - 1) >> CodePageShift; ++page) {
+      auto &info = sCodePages[page];
+      auto flags = info.flags.load();
+
+      // Dirty pages are protected again once their blocks are removed
+      if ((flags & (PageProtected | PageUnprotecting | PageDirty)) || info.invalidations >= MaxPageInvalidations) {
+         continue;
+      }
+
+      // Flag it first, a write can fault as soon as it is protected
+      info.flags.fetch_or(PageProtected | PageTracked);
+
+      if (!mem::writeProtect(page << CodePageShift, CodePageSize)) {
+         info.flags.fetch_and(static_cast<uint8_t>(~PageProtected));
+      }
+   }
+}
+
+static void
+removeBlock(uint32_t start);
+
+// Remember which pages block covers so it can be invalidated
+static void
+trackBlock(const JitBlock& block)
+{
+   // A block compiled at the same address again replaces the old one
+   removeBlock(block.start);
+
+   BlockInfo info;
+   info.start = block.start;
+   info.end = block.end;
+   info.crc = crc32(mem::translate(block.start), block.end - block.start);
+   info.code = block.code;
+   info.codeSize = block.codeSize;
+   info.region = block.region;
+   info.entries.emplace_back(block.start, block.entry);
+   info.links = block.links;
+
+   for (auto &target : block.targets) {
+      if (target.second) {
+         info.entries.emplace_back(target.first, target.second);
+      }
+   }
+
+   // Empty blocks still have code which must be removed with its region
+   if (block.end > block.start) {
+      for (auto page = block.start >> CodePageShift; page <= (block.end - 1) >> CodePageShift; ++page) {
+         sPageBlocks[page].push_back(block.start);
+      }
+
+      protectCodePages(block.start, block.end);
+   }
+
+   sBlockInfo[block.start] = std::move(info);
+}
+
+// Unpublish a block and unlink every exit which jumps into it
+static void
+removeBlock(uint32_t start)
+{
+   auto itr = sBlockInfo.find(start);
+   if (itr == sBlockInfo.end()) {
+      return;
+   }
+
+   auto &info = itr->second;
+
+   for (auto &entry : info.entries) {
+      if (sBlocks.find(entry.first) == entry.second) {
+         sBlocks.insert(entry.first, nullptr);
+      }
+   }
+
+   // Forget the exits out of this block and send them back to their stubs,
+   //   its code may still be running and must not enter a block which is
+   //   removed later without knowing about this one.
+   for (auto &link : info.links) {
+      auto &links = sLinks[link.target];
+
+      links.erase(std::remove_if(links.begin(), links.end(), [&](const JitLink &other) {
+         return other.jump == link.jump;
+      }), links.end());
+
+      patchJump(link.jump, link.stub);
+   }
+
+   // Exits into this block go back to their stub, unless another
+   //   block still provides code for that address.
+   for (auto &entry : info.entries) {
+      auto links = sLinks.find(entry.first);
+      if (links == sLinks.end()) {
+         continue;
+      }
+
+      auto code = sBlocks.find(entry.first);
+
+      for (auto &link : links->second) {
+         if (code && code != FailedBlock) {
+            patchJump(link.jump, code);
+         } else {
+            patchJump(link.jump, link.stub);
+         }
+      }
+   }
+
+   if (info.end > info.start) {
+      for (auto page = info.start >> CodePageShift; page <= (info.end - 1) >> CodePageShift; ++page) {
+         auto &blocks = sPageBlocks[page];
+         blocks.erase(std::remove(blocks.begin(), blocks.end(), start), blocks.end());
+      }
+   }
+
+   sBlockInfo.erase(itr);
+   gReturnStackEpoch++;
+}
+
+// Remove every block which contains guest code in [start, end)
+static void
+invalidateRange(uint32_t start, uint32_t end)
+{
+   std::vector<uint32_t> blocks;
+
+   for (auto page = start >> CodePageShift; page <= (end - 1) >> CodePageShift; ++page) {
+      auto itr = sPageBlocks.find(page);
+      if (itr == sPageBlocks.end()) {
+         continue;
+      }
+
+      for (auto blockStart : itr->second) {
+         auto &info = sBlockInfo.at(blockStart);
+
+         if (info.start < end && info.end > start) {
+            blocks.push_back(blockStart);
+         }
+      }
+   }
+
+   for (auto blockStart : blocks) {
+      removeBlock(blockStart);
+   }
+
+   // Allow code which previously failed to compile to be retried
+   for (auto addr = start & ~3u; addr < end && addr >= (start & ~3u); addr += 4) {
+      if (sBlocks.find(addr) == FailedBlock) {
+         sBlocks.insert(addr, nullptr);
+      }
+
+      if (sSingleBlocks.find(addr)) {
+         sSingleBlocks.insert(addr, nullptr);
+      }
+   }
+}
+
+// Called from the access violation handler, must not lock or allocate
+static bool
+handleWriteFault(uint32_t address)
+{
+   auto page = address >> CodePageShift;
+   auto &info = sCodePages[page];
+   auto flags = info.flags.load();
+
+   if (!(flags & PageTracked)) {
+      return false;
+   }
+
+   // Another core may have already dealt with this page
+   while (flags & PageProtected) {
+      auto unprotecting = static_cast<uint8_t>((flags & ~PageProtected) | PageUnprotecting);
+
+      if (info.flags.compare_exchange_weak(flags, unprotecting)) {
+         mem::writeUnprotect(page << CodePageShift, CodePageSize);
+         info.flags.fetch_or(PageDirty);
+         info.flags.fetch_and(static_cast<uint8_t>(~PageUnprotecting));
+         sDirtyCodePages.store(true);
+         break;
+      }
+   }
+
+   return true;
+}
+
+// Remove the blocks on pages written to since they were compiled, sMutex must be held
+static void
+processDirtyPages()
+{
+   if (!sDirtyCodePages.exchange(false)) {
+      return;
+   }
+
+   // Every tracked page has an entry in sPageBlocks
+   for (auto &itr : sPageBlocks) {
+      auto page = itr.first;
+      auto &info = sCodePages[page];
+
+      if (!(info.flags.load() & PageDirty)) {
+         continue;
+      }
+
+      if (info.invalidations < MaxPageInvalidations) {
+         info.invalidations++;
+      }
+
+      invalidateRange(page << CodePageShift, (page << CodePageShift) + CodePageSize);
+      info.flags.fetch_and(static_cast<uint8_t>(~PageDirty));
+   }
+}
+
+static void
+resetCodeTracking()
+{
+   for (auto page = 0u; page < CodePageCount; ++page) {
+      auto &info = sCodePages[page];
+
+      if (info.flags.load() & PageProtected) {
+         mem::writeUnprotect(page << CodePageShift, CodePageSize);
+      }
+
+      info.flags.store(0);
+      info.invalidations = 0;
+   }
+
+   sDirtyCodePages.store(false);
+   sBlockInfo.clear();
+   sPageBlocks.clear();
+}
+
+void invalidate(uint32_t address, uint32_t size)
+{
+   if (!size) {
+      return;
+   }
+
+   std::unique_lock<std::mutex> lock(sMutex);
+   processDirtyPages();
+   invalidateRange(address, address + size);
+}
+
+// Check blocks on pages which are no longer write protected, as writes
+//   to those are not seen, and remove any whose guest code has changed.
+void invalidateModified()
+{
+   std::unique_lock<std::mutex> lock(sMutex);
+   std::vector<uint32_t> blocks;
+   processDirtyPages();
+
+   for (auto &itr : sBlockInfo) {
+      auto &info = itr.second;
+      auto unprotected = false;
+
+      if (info.end <= info.start) {
+         continue;
+      }
+
+      for (auto page = info.start >> CodePageShift; page <= (info.end - 1) >> CodePageShift; ++page) {
+         if (!(sCodePages[page].flags.load() & PageProtected)) {
+            unprotected = true;
+            break;
+         }
+      }
+
+      if (unprotected && crc32(mem::translate(info.start), info.end - info.start) != info.crc) {
+         blocks.push_back(info.start);
+      }
+   }
+
+   for (auto blockStart : blocks) {
+      removeBlock(blockStart);
+   }
 }
 
 bool jit_b(PPCEmuAssembler& a, Instruction instr, uint32_t cia, const JumpLabelMap& jumpLabels);
@@ -124,9 +614,241 @@ bool jit_bclr(PPCEmuAssembler& a, Instruction instr, uint32_t cia, const JumpLab
 
 using JumpTargetList = std::vector<uint32_t>;
 
+// Keep the most used guest GPRs of a block in host registers
+static void
+allocGprCache(PPCEmuAssembler& a, const JitIrBlock& ir)
+{
+   const asmjit::X86GpReg hostRegs[JIT_MAX_CACHED_GPR] = {
+      asmjit::x86::ebp,
+      asmjit::x86::r13d,
+      asmjit::x86::r14d,
+      asmjit::x86::r15d,
+   };
+
+   uint32_t uses[32] = { 0 };
+   bool written[32] = { false };
+
+   for (auto &inst : ir.insts) {
+      auto instr = inst.instr;
+      auto data = inst.data;
+
+      if (!data || inst.dead) {
+         continue;
+      }
+
+      for (auto field : data->read) {
+         auto gpr = getGprField(instr, field);
+
+         if (gpr >= 0) {
+            uses[gpr]++;
+         }
+      }
+
+      for (auto field : data->write) {
+         auto gpr = getGprField(instr, field);
+
+         if (gpr >= 0) {
+            uses[gpr]++;
+            written[gpr] = true;
+         }
+      }
+   }
+
+   std::vector<int> order;
+   for (auto i = 0; i < 32; ++i) {
+      order.push_back(i);
+   }
+
+   std::stable_sort(order.begin(), order.end(), [&](int x, int y) {
+      return uses[x] > uses[y];
+   });
+
+   for (auto i = 0; i < JIT_MAX_CACHED_GPR; ++i) {
+      auto gpr = order[i];
+
+      // Caching a register used only once just adds a load
+      if (uses[gpr] < 2) {
+         break;
+      }
+
+      a.gprCache[gpr] = hostRegs[i];
+      a.gprCached[gpr] = true;
+      a.gprDirty[gpr] = written[gpr];
+   }
+}
+
+// Remove every block with code in an arena region so it can be reused
+static void
+retireRegion(uint32_t index)
+{
+   std::vector<uint32_t> blocks;
+
+   for (auto &itr : sBlockInfo) {
+      if (itr.second.region == index) {
+         blocks.push_back(itr.first);
+      }
+   }
+
+   for (auto blockStart : blocks) {
+      removeBlock(blockStart);
+   }
+
+   for (auto itr = sSingleBlockRegions.begin(); itr != sSingleBlockRegions.end(); ) {
+      if (itr->second == index) {
+         sSingleBlocks.insert(itr->first, nullptr);
+         itr = sSingleBlockRegions.erase(itr);
+      } else {
+         ++itr;
+      }
+   }
+
+   gLog->debug("Retiring JIT code region {} with {} blocks", index, blocks.size());
+   sArena.retire(index);
+}
+
+// Returns executable memory for size bytes of code, once the arena is
+//   full the oldest region is retired and reused. Sets sArenaFull if it
+//   cannot be reused yet, in which case the caller should try again later.
+static uint8_t *
+allocateCode(size_t size, uint32_t &region)
+{
+   sArenaFull = false;
+
+   if (size > sArena.getRegionSize()) {
+      return nullptr;
+   }
+
+   auto code = sArena.allocate(size);
+
+   if (!code) {
+      auto next = sArena.next();
+      auto &info = sArena.getRegion(next);
+
+      if (info.used && !info.retired) {
+         retireRegion(next);
+      }
+
+      if (!sArena.reuse(next)) {
+         // Another core may still be running code from it
+         sArenaFull = true;
+         return nullptr;
+      }
+
+      code = sArena.allocate(size);
+   }
+
+   region = sArena.current();
+   return code;
+}
+
+// Fill in block from code laid out as described by layout, this is
+//   shared by freshly generated blocks and ones from the cache.
+static void
+placeBlock(JitBlock& block, uint8_t *func, size_t size, uint32_t region, const JitCachedBlock& layout)
+{
+   auto generation = sArena.getRegion(region).generation.load();
+
+   for (auto &reloc : layout.relocs) {
+      uint64_t value;
+
+      if (reloc.symbol == JitSymbol::CodeRegion) {
+         value = (static_cast<uint64_t>(region) << 32) | generation;
+      } else {
+         value = reinterpret_cast<uint64_t>(getSymbolAddress(reloc.symbol, reloc.index));
+      }
+
+      std::memcpy(func + reloc.offset + 2, &value, sizeof(value));
+   }
+
+   block.code = func;
+   block.codeSize = size;
+   block.region = region;
+   block.end = layout.end;
+   block.entry = func + layout.entry;
+
+   for (auto &target : layout.targets) {
+      block.targets[target.first] = func + target.second;
+   }
+
+   for (auto &exit : layout.exits) {
+      JitLink link;
+      link.target = exit.target;
+      link.jump = func + exit.jump;
+      link.stub = func + exit.stub;
+      patchJump(link.jump, link.stub);
+      block.links.push_back(link);
+   }
+}
+
+// Copy a block out of the translation cache into executable memory
+static bool
+loadBlock(JitBlock& block, const JitCachedBlock& cached)
+{
+   uint32_t region;
+   auto func = allocateCode(cached.code.size(), region);
+
+   if (func == nullptr) {
+      if (!sArenaFull) {
+         gLog->error("JIT failed to allocate {} bytes of code", cached.code.size());
+      }
+
+      return false;
+   }
+
+   std::memcpy(func, cached.code.data(), cached.code.size());
+   placeBlock(block, func, cached.code.size(), region, cached);
+   return true;
+}
+
+// Called from generated code before an instruction with a breakpoint,
+//   the callout keeps the block alive if the breakpoint is removed whilst
+//   the core is paused on it.
+void
+jit_breakpoint_stub(ThreadState *state, uint32_t cia, uint64_t region)
+{
+   beginCallout(state, region);
+   state->cia = cia;
+   state->nia = cia + 4;
+   gDebugControl.maybeBreak(cia, state, gProcessor.getCoreID());
+   endCallout(state, region);
+}
+
+// Trap into the debugger before the instruction at cia
+static void
+jit_breakpoint(PPCEmuAssembler& a, uint32_t cia)
+{
+   jit_flush_time(a);
+   a.flushGprCache();
+   a.mov(a.zcx, a.state);
+   a.mov(a.edx, cia);
+   a.movSymbol(asmjit::x86::r8, JitSymbol::CodeRegion);
+   a.movSymbol(a.zax, JitSymbol::BreakpointStub);
+   a.call(a.zax);
+   a.loadGprCache();
+}
+
 bool gen(JitBlock& block)
 {
+   // Only blocks which contain a breakpoint pay for checking them
+   BreakpointList breakpoints;
+
+   if (gDebugger.isEnabled() && gDebugger.hasBreakpointInRange(block.start, block.end)) {
+      breakpoints = std::atomic_load(&gDebugger.getBreakpoints());
+      block.breakpoints = true;
+   }
+
+   JitIrBlock ir;
+   buildIr(ir, block);
+   optimiseIr(ir, block.breakpoints);
+
    PPCEmuAssembler a(sRuntime);
+   allocGprCache(a, ir);
+   a.virtualTime = cpu::isVirtualTime();
+
+   if (block.gqrKnown) {
+      a.gqrKnown = true;
+      std::copy(std::begin(block.gqr), std::end(block.gqr), std::begin(a.gqrValues));
+   }
 
    JumpLabelMap jumpLabels;
    for (auto i = block.targets.begin(); i != block.targets.end(); ++i) {
@@ -135,6 +857,15 @@ bool gen(JitBlock& block)
       }
    }
 
+   // Entering the middle of the block from outside has to load the GPR
+   //   cache first, internal jumps go straight to the instruction.
+   a.entryLabels = jumpLabels;
+   if (a.hasGprCache()) {
+      for (auto &i : a.entryLabels) {
+         i.second = asmjit::Label(a);
+      }
+   }
+
    // Fix VS debug viewer...
    if (JIT_DEBUG) {
       for (int i = 0; i < 8; ++i) {
@@ -144,23 +875,45 @@ bool gen(JitBlock& block)
 
    asmjit::Label codeStart(a);
    a.bind(codeStart);
+   a.loadGprCache();
 
-   auto lclCia = block.start;
-   while (lclCia < block.end) {
+   for (auto &inst : ir.insts) {
+      auto lclCia = inst.cia;
       auto ciaLbl = jumpLabels.find(lclCia);
       if (ciaLbl != jumpLabels.end()) {
+         jit_flush_time(a);
          a.bind(ciaLbl->second);
       }
 
+      if (breakpoints && breakpoints->count(lclCia)) {
+         jit_breakpoint(a, lclCia);
+      }
+
+      a.pendingTime++;
+
       if (JIT_DEBUG) {
          a.mov(a.cia, lclCia);
       }
 
-      auto instr = mem::read<Instruction>(lclCia);
-      auto data = gInstructionTable.decode(instr);
+      auto instr = inst.instr;
+      auto data = inst.data;
+
+      a.cr0Live = (inst.liveFlags & FlagCr0) != 0;
+      a.carryLive = (inst.liveFlags & FlagCarry) != 0;
+      a.addressKnown = inst.hasAddress;
+      a.address = inst.address;
+      a.rawLoad = inst.rawLoad;
+      a.rawStore = inst.rawStore;
+      a.idleLoop = inst.idleLoop;
 
       bool genSuccess = false;
-      if (data->id == InstructionID::b) {
+      if (inst.dead) {
+         genSuccess = true;
+      } else if (inst.hasResult) {
+         a.mov(a.eax, inst.result);
+         a.storeGpr(inst.dest, a.eax);
+         genSuccess = true;
+      } else if (data->id == InstructionID::b) {
          genSuccess = jit_b(a, instr, lclCia, jumpLabels);
       } else if (data->id == InstructionID::bc) {
          genSuccess = jit_bc(a, instr, lclCia, jumpLabels);
@@ -182,8 +935,6 @@ bool gen(JitBlock& block)
       if (JIT_DEBUG) {
          a.nop();
       }
-
-      lclCia += 4;
    }
 
    // Debug Check
@@ -193,21 +944,66 @@ bool gen(JitBlock& block)
       }
    }
 
-   a.mov(a.eax, block.end);
-   a.jmp(asmjit::Ptr(gFinaleFn));
+   jit_flush_time(a);
+   jit_exit(a, block.end);
+
+   if (a.hasGprCache()) {
+      for (auto &i : a.entryLabels) {
+         a.bind(i.second);
+         a.loadGprCache();
+         a.jmp(jumpLabels[i.first]);
+      }
+   }
+
+   // Exit stubs return to the dispatcher until their exit has been linked
+   for (auto &exit : a.exits) {
+      a.bind(exit.stub);
+      a.mov(a.eax, exit.target);
+      a.movSymbol(a.zcx, JitSymbol::Finale);
+      a.jmp(a.zcx);
+   }
+
+   uint32_t region;
+   auto codeSize = a.getCodeSize();
+   auto func = allocateCode(codeSize, region);
 
-   JitCode func = asmjit_cast<JitCode>(a.make());
    if (func == nullptr) {
-      gLog->error("JIT failed due to asmjit make failure");
+      if (!sArenaFull) {
+         gLog->error("JIT failed to allocate {} bytes of code", codeSize);
+      }
+
       return false;
    }
 
-   auto baseAddr = asmjit_cast<JitCode>(func, a.getLabelOffset(codeStart));
-   block.entry = baseAddr;
-   for (auto i = jumpLabels.cbegin(); i != jumpLabels.cend(); ++i) {
-      block.targets[i->first] = asmjit_cast<JitCode>(func, a.getLabelOffset(i->second));
+   codeSize = a.relocCode(func);
+
+   auto &layout = block.layout;
+   layout.start = block.start;
+   layout.end = block.end;
+   layout.entry = static_cast<uint32_t>(a.getLabelOffset(codeStart));
+
+   for (auto i = a.entryLabels.cbegin(); i != a.entryLabels.cend(); ++i) {
+      layout.targets[i->first] = static_cast<uint32_t>(a.getLabelOffset(i->second));
+   }
+
+   for (auto &exit : a.exits) {
+      JitCachedExit cachedExit;
+      cachedExit.target = exit.target;
+      cachedExit.jump = static_cast<uint32_t>(a.getLabelOffset(exit.jump));
+      cachedExit.stub = static_cast<uint32_t>(a.getLabelOffset(exit.stub));
+      layout.exits.push_back(cachedExit);
    }
 
+   for (auto &reloc : a.relocs) {
+      JitCachedReloc cachedReloc;
+      cachedReloc.offset = static_cast<uint32_t>(a.getLabelOffset(reloc.label));
+      cachedReloc.symbol = reloc.symbol;
+      cachedReloc.index = reloc.index;
+      layout.relocs.push_back(cachedReloc);
+   }
+
+   layout.code.assign(func, func + codeSize);
+   placeBlock(block, func, codeSize, region, layout);
    return true;
 }
 
@@ -314,66 +1110,241 @@ bool identBlock(JitBlock& block)
    return true;
 }
 
-static std::mutex sMutex;
-
-JitCode get(uint32_t addr)
+// Compile the block at addr and publish it, sMutex must be held
+static JitCode
+compileBlock(uint32_t addr, const uint32_t *gqr)
 {
-   std::unique_lock<std::mutex> lock(sMutex);
-
-   auto i = sBlocks.find(addr);
-   if (i != sBlocks.end()) {
-      return i->second;
+   // Another thread may have compiled it whilst we waited for the lock
+   auto code = sBlocks.find(addr);
+   if (code) {
+      return code != FailedBlock ? code : nullptr;
    }
 
-   // Set it to nullptr first so we don't
+   // Blocks must not be tracked on a page before its old blocks are gone
+   processDirtyPages();
+
+   // Mark it as failed first so we don't
    //   try to regenerate after a failed attempt.
-   sBlocks[addr] = nullptr;
+   sBlocks.insert(addr, FailedBlock);
 
    JitBlock block(addr);
 
-   gLog->debug("Attempting to JIT {:08x}", block.start);
+   if (gqr) {
+      block.gqrKnown = true;
 
-   if (!identBlock(block)) {
-      return nullptr;
+      for (auto i = 0; i < 8; ++i) {
+         block.gqr[i] = gqr[i];
+      }
    }
 
-   gLog->debug("Found end at {:08x}", block.end);
+   auto cached = findCachedBlock(addr);
 
-   if (!gen(block)) {
-      return nullptr;
+   // Cached code has no breakpoint traps
+   if (cached && gDebugger.isEnabled() && gDebugger.hasBreakpointInRange(cached->start, cached->end)) {
+      cached = nullptr;
+   }
+
+   if (cached) {
+      gLog->debug("Loading cached JIT block {:08x}", block.start);
+
+      if (!loadBlock(block, *cached)) {
+         // Retry once the arena has a region free again
+         if (sArenaFull) {
+            sBlocks.insert(addr, nullptr);
+         }
+
+         return nullptr;
+      }
+   } else {
+      gLog->debug("Attempting to JIT {:08x}", block.start);
+
+      if (!identBlock(block)) {
+         return nullptr;
+      }
+
+      gLog->debug("Found end at {:08x}", block.end);
+
+      if (!gen(block)) {
+         if (sArenaFull) {
+            sBlocks.insert(addr, nullptr);
+         }
+
+         return nullptr;
+      }
+
+      if (!block.breakpoints) {
+         addCachedBlock(block.layout);
+      }
    }
 
-   sBlocks[block.start] = block.entry;
+   sBlocks.insert(block.start, block.entry);
+   linkTarget(block.start, block.entry);
+
    for (auto i = block.targets.cbegin(); i != block.targets.cend(); ++i) {
       if (i->second) {
-         sBlocks[i->first] = i->second;
+         sBlocks.insert(i->first, i->second);
+         linkTarget(i->first, i->second);
       }
    }
+
+   for (auto &link : block.links) {
+      addLink(link);
+   }
+
+   trackBlock(block);
+   sCompiledBlocks.fetch_add(1, std::memory_order_relaxed);
    return block.entry;
 }
 
+JitCode get(ThreadState *state, uint32_t addr)
+{
+   auto code = sBlocks.find(addr);
+   if (code) {
+      return code != FailedBlock ? code : nullptr;
+   }
+
+   uint32_t gqr[8];
+
+   if (state) {
+      for (auto i = 0; i < 8; ++i) {
+         gqr[i] = state->gqr[i].value;
+      }
+   }
+
+   std::unique_lock<std::mutex> lock(sMutex);
+   return compileBlock(addr, state ? gqr : nullptr);
+}
+
+static void
+compileThreadEntry()
+{
+   std::unique_lock<std::mutex> lock(sCompileMutex);
+
+   while (sCompileRunning) {
+      if (sCompileQueue.empty()) {
+         sCompileCondition.wait(lock);
+         continue;
+      }
+
+      auto request = sCompileQueue.front();
+      sCompileQueue.pop_front();
+      lock.unlock();
+
+      {
+         std::unique_lock<std::mutex> jitLock(sMutex);
+         compileBlock(request.addr, request.gqrKnown ? request.gqr : nullptr);
+      }
+
+      lock.lock();
+      sCompileQueued.erase(request.addr);
+   }
+}
+
+// Queue addr to be compiled on a compile thread
+static void
+queueCompile(ThreadState *state, uint32_t addr)
+{
+   std::unique_lock<std::mutex> lock(sCompileMutex);
+
+   if (!sCompileQueued.insert(addr).second) {
+      return;
+   }
+
+   CompileRequest request;
+   request.addr = addr;
+   request.gqrKnown = true;
+
+   for (auto i = 0; i < 8; ++i) {
+      request.gqr[i] = state->gqr[i].value;
+   }
+
+   sCompileQueue.push_back(request);
+   sCompileCondition.notify_one();
+}
+
+// Returns the code for addr if it is ready, otherwise when compile
+//   threads are running it is queued and nullptr is returned so the
+//   caller can interpret the block in the meantime.
+static JitCode
+getAsync(ThreadState *state, uint32_t addr)
+{
+   if (sCompileThreads.empty()) {
+      return get(state, addr);
+   }
+
+   auto code = sBlocks.find(addr);
+   if (code) {
+      return code != FailedBlock ? code : nullptr;
+   }
+
+   queueCompile(state, addr);
+   return nullptr;
+}
+
+void startCompileThreads(unsigned count)
+{
+   sCompileRunning = true;
+
+   for (auto i = 0u; i < count; ++i) {
+      sCompileThreads.emplace_back(compileThreadEntry);
+      platform::setThreadName(&sCompileThreads.back(), "JIT Compile Thread");
+   }
+}
+
+void stopCompileThreads()
+{
+   {
+      std::unique_lock<std::mutex> lock(sCompileMutex);
+      sCompileRunning = false;
+      sCompileQueue.clear();
+      sCompileQueued.clear();
+   }
+
+   sCompileCondition.notify_all();
+
+   for (auto &thread : sCompileThreads) {
+      thread.join();
+   }
+
+   sCompileThreads.clear();
+}
+
 bool prepare(uint32_t addr)
 {
-   return get(addr) != nullptr;
+   return get(nullptr, addr) != nullptr;
 }
 
 JitCode getSingle(uint32_t addr)
 {
-   auto i = sSingleBlocks.find(addr);
-   if (i != sSingleBlocks.end()) {
-      return i->second;
+   auto code = sSingleBlocks.find(addr);
+   if (code) {
+      return code != FailedBlock ? code : nullptr;
+   }
+
+   std::unique_lock<std::mutex> lock(sMutex);
+
+   code = sSingleBlocks.find(addr);
+   if (code) {
+      return code != FailedBlock ? code : nullptr;
    }
 
-   sSingleBlocks[addr] = nullptr;
+   sSingleBlocks.insert(addr, FailedBlock);
 
+   // Single instruction blocks are never linked, their
+   //   exits always return to the dispatcher.
    JitBlock block(addr);
    block.end = block.start + 4;
 
    if (!gen(block)) {
+      if (sArenaFull) {
+         sSingleBlocks.insert(addr, nullptr);
+      }
+
       return nullptr;
    }
 
-   sSingleBlocks[addr] = block.entry;
+   sSingleBlocks.insert(addr, block.entry);
+   sSingleBlockRegions[addr] = block.region;
    return block.entry;
 }
 
@@ -382,17 +1353,117 @@ uint32_t execute(ThreadState *state, JitCode block)
    return gCallFn(state, state->core, block);
 }
 
+// Run the block at state->nia if it is still compiled, code looked up
+//   before entering the arena may belong to a region retired since.
+static void
+runBlock(ThreadState *state)
+{
+   if (sDirtyCodePages.load(std::memory_order_relaxed)) {
+      std::unique_lock<std::mutex> lock(sMutex);
+      processDirtyPages();
+   }
+
+   state->jitEpoch = sArena.enter();
+
+   auto code = sBlocks.find(state->nia);
+
+   if (code && code != FailedBlock) {
+      auto newNia = execute(state, code);
+      state->cia = 0;
+      state->nia = newNia;
+   }
+
+   // A callout may have switched epoch, so leave whichever it entered
+   sArena.leave(state->jitEpoch);
+
+   if (state->jitPinnedRegion) {
+      sArena.unpin(state->jitPinnedRegion - 1);
+      state->jitPinnedRegion = 0;
+   }
+}
+
+void beginCallout(ThreadState *state, uint64_t region)
+{
+   auto index = static_cast<uint32_t>(region >> 32);
+   sArena.pin(index);
+   sArena.leave(state->jitEpoch);
+
+   if (state->jitCalloutDepth < JitMaxCalloutDepth) {
+      state->jitCalloutRegions[state->jitCalloutDepth] = index;
+   }
+
+   state->jitCalloutDepth++;
+}
+
+// If the region was retired whilst we were away its code can no longer
+//   be safely reclaimed by epoch, so the pin is kept until this thread
+//   returns to the dispatcher.
+void endCallout(ThreadState *state, uint64_t region)
+{
+   auto index = static_cast<uint32_t>(region >> 32);
+   auto generation = static_cast<uint32_t>(region);
+
+   state->jitCalloutDepth--;
+   state->jitEpoch = sArena.enter();
+
+   if (sArena.getRegion(index).generation.load() == generation || state->jitPinnedRegion == index + 1) {
+      sArena.unpin(index);
+   } else if (!state->jitPinnedRegion) {
+      state->jitPinnedRegion = index + 1;
+   } else {
+      // Only code in one retired region can run before the dispatcher
+      sArena.unpin(state->jitPinnedRegion - 1);
+      state->jitPinnedRegion = index + 1;
+   }
+}
+
+// A thread exiting from inside a callout never returns to endCallout or
+//   the dispatcher, so drop the pins it still holds. Its epoch was left
+//   when the callout began.
+void releaseThread(ThreadState *state)
+{
+   auto depth = std::min(state->jitCalloutDepth, JitMaxCalloutDepth);
+
+   for (auto i = 0u; i < depth; ++i) {
+      sArena.unpin(state->jitCalloutRegions[i]);
+   }
+
+   if (state->jitCalloutDepth > JitMaxCalloutDepth) {
+      gLog->warn("Thread exited {} callouts deep, leaking {} JIT region pins",
+                 state->jitCalloutDepth, state->jitCalloutDepth - JitMaxCalloutDepth);
+   }
+
+   state->jitCalloutDepth = 0;
+
+   if (state->jitPinnedRegion) {
+      sArena.unpin(state->jitPinnedRegion - 1);
+      state->jitPinnedRegion = 0;
+   }
+}
+
+// Interpret up to and including the next taken branch, which
+//   is where the next block starts.
+static void
+interpretBlock(ThreadState *state)
+{
+   sInterpretedBlocks.fetch_add(1, std::memory_order_relaxed);
+
+   do {
+      interpreter::step(state);
+   } while (state->nia == state->cia + 4);
+}
+
 void execute(ThreadState *state)
 {
    while (state->nia != cpu::CALLBACK_ADDR) {
-      JitCode jitFn = get(state->nia);
+      JitCode jitFn = getAsync(state, state->nia);
       if (!jitFn) {
-         throw;
+         // Still compiling, failed to compile or out of code memory
+         interpretBlock(state);
+         continue;
       }
 
-      auto newNia = execute(state, jitFn);
-      state->cia = 0;
-      state->nia = newNia;
+      runBlock(state);
    }
 }
 
@@ -406,6 +1477,60 @@ void executeSub(ThreadState *state)
    state->lr = lr;
 }
 
+// Count an entry to addr, returns true once it has been entered enough
+//   times to be worth compiling.
+static bool
+isHotBlock(uint32_t addr)
+{
+   auto index = ((addr >> 2) ^ (addr >> 18)) & (TierCounterCount - 1);
+   auto count = sTierCounters[index].fetch_add(1, std::memory_order_relaxed) + 1;
+   return count >= sTierThreshold;
+}
+
+static void
+executeTiered(ThreadState *state)
+{
+   while (state->nia != cpu::CALLBACK_ADDR) {
+      auto code = sBlocks.find(state->nia);
+
+      if (!code && isHotBlock(state->nia)) {
+         code = getAsync(state, state->nia);
+      }
+
+      if (code && code != FailedBlock) {
+         sJitBlocks.fetch_add(1, std::memory_order_relaxed);
+         runBlock(state);
+         continue;
+      }
+
+      interpretBlock(state);
+   }
+}
+
+void executeSubTiered(ThreadState *state)
+{
+   auto lr = state->lr;
+   state->lr = CALLBACK_ADDR;
+
+   executeTiered(state);
+
+   state->lr = lr;
+}
+
+void setTierThreshold(uint32_t threshold)
+{
+   sTierThreshold = threshold;
+}
+
+TierStats getTierStats()
+{
+   TierStats stats;
+   stats.interpretedBlocks = sInterpretedBlocks.load(std::memory_order_relaxed);
+   stats.jitBlocks = sJitBlocks.load(std::memory_order_relaxed);
+   stats.compiledBlocks = sCompiledBlocks.load(std::memory_order_relaxed);
+   return stats;
+}
+
 bool PPCEmuAssembler::ErrorHandler::handleError(asmjit::Error code, const char* message, void* origin)
 {
    gLog->error("ASMJit Error {}: {}\n", code, message);
@@ -415,3 +1540,16 @@ bool PPCEmuAssembler::ErrorHandler::handleError(asmjit::Error code, const char*
 } // namespace jit
 
 } // namespace cpu
+
+void tierStatsPrint()
+{
+   auto stats = cpu::jit::getTierStats();
+
+   fmt::MemoryWriter out;
+   out.write("Tiered Execution:\n");
+   out.write("  Interpreted blocks: {}\n", stats.interpretedBlocks);
+   out.write("  JIT blocks: {}\n", stats.jitBlocks);
+   out.write("  Compiled blocks: {}", stats.compiledBlocks);
+
+   gLog->info(out.str());
+}
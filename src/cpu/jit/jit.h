@@ -1,4 +1,6 @@
 #pragma once
+#include <cstdint>
+#include <string>
 #include "../cpu.h"
 
 namespace cpu
@@ -6,12 +8,46 @@ namespace cpu
 namespace jit
 {
 
+struct TierStats
+{
+   uint64_t interpretedBlocks;   // Blocks run by the interpreter
+   uint64_t jitBlocks;           // Entries into JIT code from the dispatcher
+   uint64_t compiledBlocks;      // Blocks compiled by the JIT
+};
+
 void initialise();
 
+// Maximum amount of host memory used for generated code, must be
+//   called before initialise.
+void setCodeCacheSize(size_t size);
+
 void clearCache();
+void invalidate(uint32_t address, uint32_t size);
+void invalidateModified();
 void executeSub(ThreadState *state);
 
+// Release the code arena pins of a guest thread which is exiting
+void releaseThread(ThreadState *state);
+
+// Tiered execution, interprets until an address has been entered
+//   threshold times then executes it from the JIT.
+void executeSubTiered(ThreadState *state);
+void setTierThreshold(uint32_t threshold);
+TierStats getTierStats();
+
+// Compile blocks on background threads, cores interpret a
+//   block until its compiled code has been published.
+void startCompileThreads(unsigned count);
+void stopCompileThreads();
+
+// Translation cache, compiled blocks for registered code regions are
+//   saved to path and reused by later runs of the same code.
+void setCachePath(const std::string &path);
+void registerCodeRegion(const std::string &name, uint32_t start, uint32_t end);
+void saveCache();
+
 }
 }
 
 void fallbacksPrint();
+void tierStatsPrint();
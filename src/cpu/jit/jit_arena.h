@@ -0,0 +1,240 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include "platform/platform_memorymap.h"
+
+namespace cpu
+{
+
+namespace jit
+{
+
+/**
+ * Fixed size pool of executable memory for generated blocks.
+ *
+ * The pool is split into regions which are filled one after another, once
+ * the last one is full the oldest region is retired and reused. Retiring a
+ * region only bumps its generation, the caller must first remove every
+ * block in it so nothing new can enter its code.
+ *
+ * A retired region may still be running on another core, so it is only
+ * reused once that is no longer possible. Threads running generated code
+ * count themselves in the epoch they entered at, a region retired in epoch
+ * E is reusable once every thread which entered at or before E has left.
+ * Calls out of generated code which may switch fibers leave their epoch and
+ * pin the region they return to instead, so a guest thread sleeping in a
+ * kernel call holds back that region only.
+ *
+ * allocate / retire / reuse / reset must only be called by a single writer
+ * at a time, enter / leave / pin / unpin may be called from any core.
+ */
+class JitCodeArena
+{
+public:
+   static const uint32_t RegionCount = 8;
+   static const uint32_t EpochCount = 16;
+   static const size_t Alignment = 16;
+
+   struct Region
+   {
+      uint8_t *base = nullptr;
+      size_t used = 0;
+      bool retired = false;
+      uint32_t retireEpoch = 0;
+      std::atomic<uint32_t> generation { 0 };
+      std::atomic<uint32_t> pins { 0 };
+   };
+
+   ~JitCodeArena()
+   {
+      if (mBase) {
+         platform::freeExecutableMemory(mBase, mRegionSize * RegionCount);
+      }
+   }
+
+   bool
+   initialise(size_t size)
+   {
+      // Keep regions a whole number of 64kb so they stay page aligned
+      mRegionSize = std::max<size_t>(size / RegionCount, 0x10000) & ~size_t { 0xFFFF };
+      mBase = static_cast<uint8_t *>(platform::allocateExecutableMemory(mRegionSize * RegionCount));
+
+      if (!mBase) {
+         return false;
+      }
+
+      for (auto i = 0u; i < RegionCount; ++i) {
+         mRegions[i].base = mBase + i * mRegionSize;
+      }
+
+      reset();
+      return true;
+   }
+
+   // Returns size bytes from the current region, or nullptr if it is full
+   uint8_t *
+   allocate(size_t size)
+   {
+      auto &region = mRegions[mCurrent];
+      size = (size + Alignment - 1) & ~(Alignment - 1);
+
+      if (!mBase || region.used + size > mRegionSize) {
+         return nullptr;
+      }
+
+      auto ptr = region.base + region.used;
+      region.used += size;
+      return ptr;
+   }
+
+   uint32_t
+   current() const
+   {
+      return mCurrent;
+   }
+
+   uint32_t
+   next() const
+   {
+      return (mCurrent + 1) % RegionCount;
+   }
+
+   Region &
+   getRegion(uint32_t index)
+   {
+      return mRegions[index];
+   }
+
+   size_t
+   getRegionSize() const
+   {
+      return mRegionSize;
+   }
+
+   // Mark index as no longer holding any reachable blocks, nothing more is
+   //   allocated from it until it is reused.
+   void
+   retire(uint32_t index)
+   {
+      auto &region = mRegions[index];
+      region.generation.fetch_add(1);
+      region.retired = true;
+      region.retireEpoch = mEpoch.load();
+      region.used = mRegionSize;
+
+      // Threads entering from now on can only see the new tables
+      tryAdvanceEpoch();
+   }
+
+   // Make index the current region if nothing can be running in it
+   bool
+   reuse(uint32_t index)
+   {
+      auto &region = mRegions[index];
+
+      if (region.pins.load() != 0) {
+         return false;
+      }
+
+      if (region.retired && !isQuiescent(region.retireEpoch)) {
+         return false;
+      }
+
+      region.used = 0;
+      region.retired = false;
+      mCurrent = index;
+      return true;
+   }
+
+   // Not safe to call whilst another thread may be running generated code
+   void
+   reset()
+   {
+      for (auto &region : mRegions) {
+         region.used = 0;
+         region.retired = false;
+         region.generation.fetch_add(1);
+      }
+
+      mCurrent = 0;
+   }
+
+   // Called before running generated code, returns the epoch to leave
+   uint32_t
+   enter()
+   {
+      while (true) {
+         auto epoch = mEpoch.load();
+         mThreads[epoch % EpochCount].fetch_add(1);
+
+         // The epoch may have moved on before we were counted in it
+         if (mEpoch.load() == epoch) {
+            return epoch;
+         }
+
+         mThreads[epoch % EpochCount].fetch_sub(1);
+      }
+   }
+
+   void
+   leave(uint32_t epoch)
+   {
+      mThreads[epoch % EpochCount].fetch_sub(1);
+   }
+
+   void
+   pin(uint32_t index)
+   {
+      mRegions[index].pins.fetch_add(1);
+   }
+
+   void
+   unpin(uint32_t index)
+   {
+      mRegions[index].pins.fetch_sub(1);
+   }
+
+private:
+   // The slot for the new epoch is still in use by threads which entered
+   //   EpochCount epochs ago, in which case the epoch stays where it is.
+   void
+   tryAdvanceEpoch()
+   {
+      auto epoch = mEpoch.load();
+
+      if (mThreads[(epoch + 1) % EpochCount].load() == 0) {
+         mEpoch.store(epoch + 1);
+      }
+   }
+
+   // True once no thread which entered at or before epoch is still running
+   bool
+   isQuiescent(uint32_t epoch)
+   {
+      tryAdvanceEpoch();
+
+      auto current = mEpoch.load();
+      auto age = current - epoch;
+
+      for (auto i = age; i < EpochCount; ++i) {
+         if (mThreads[(current - i) % EpochCount].load() != 0) {
+            return false;
+         }
+      }
+
+      return true;
+   }
+
+private:
+   uint8_t *mBase = nullptr;
+   size_t mRegionSize = 0;
+   uint32_t mCurrent = 0;
+   Region mRegions[RegionCount];
+   std::atomic<uint32_t> mEpoch { 0 };
+   std::atomic<uint32_t> mThreads[EpochCount] = { };
+};
+
+} // namespace jit
+
+} // namespace cpu
@@ -1,3 +1,4 @@
+#include <cstddef>
 #include "jit_insreg.h"
 #include "../cpu_internal.h"
 #include "utils/bitutils.h"
@@ -25,22 +26,145 @@ enum BcFlags
 };
 
 void
-jit_interrupt_stub(ThreadState *state)
+jit_interrupt_stub(ThreadState *state, uint64_t region)
 {
-   cpu::gInterruptHandler(state->core, state);
+   // Also called when the virtual time deadline has been reached
+   cpu::advanceVirtualTime(state->core, 0);
+
+   if (state->core->interrupt.load()) {
+      beginCallout(state, region);
+      cpu::gInterruptHandler(state->core, state);
+      endCallout(state, region);
+   }
+}
+
+static const int32_t
+VirtualTimeOffset = static_cast<int32_t>(offsetof(cpu::CoreState, virtualTime));
+
+static const int32_t
+VirtualDeadlineOffset = static_cast<int32_t>(offsetof(cpu::CoreState, virtualDeadline));
+
+// Add the instructions run since the last flush to the core's virtual
+//   time, must be emitted before every label a jump may land on.
+void
+jit_flush_time(PPCEmuAssembler& a)
+{
+   if (a.virtualTime && a.pendingTime) {
+      a.add(asmjit::X86Mem(a.interruptAddr, VirtualTimeOffset, 8), a.pendingTime);
+   }
+
+   a.pendingTime = 0;
+}
+
+void
+jit_idle_stub(ThreadState *state, uint64_t region)
+{
+   if (cpu::gIdleHandler) {
+      beginCallout(state, region);
+      cpu::gIdleHandler(state->core, state);
+      endCallout(state, region);
+   }
 }
 
 void
 jit_b_check_interrupt(PPCEmuAssembler& a, uint32_t cia)
 {
    asmjit::Label noInterrupt(a);
-   a.cmp(asmjit::X86Mem(a.interruptAddr, 0, 4), 0);
+   asmjit::Label interrupt(a);
+
+   if (a.virtualTime) {
+      jit_flush_time(a);
+      a.mov(a.zax, asmjit::X86Mem(a.interruptAddr, VirtualTimeOffset, 8));
+      a.cmp(a.zax, asmjit::X86Mem(a.interruptAddr, VirtualDeadlineOffset, 8));
+      a.jae(interrupt);
+   }
+
+   a.cmp(asmjit::X86Mem(a.interruptAddr, 0, 1), 0);
    a.je(noInterrupt);
+   a.bind(interrupt);
+   a.flushGprCache();
    a.mov(a.zcx, a.state);
-   a.call(asmjit::Ptr(jit_interrupt_stub));
+   a.movSymbol(a.zdx, JitSymbol::CodeRegion);
+   a.movSymbol(a.zax, JitSymbol::InterruptStub);
+   a.call(a.zax);
+   a.loadGprCache();
    a.bind(noInterrupt);
 }
 
+// Let the core do something else whilst the guest spins in an idle
+//   loop, emitted on the taken path of the loop branch.
+static void
+jit_idle(PPCEmuAssembler& a)
+{
+   a.flushGprCache();
+   a.mov(a.zcx, a.state);
+   a.movSymbol(a.zdx, JitSymbol::CodeRegion);
+   a.movSymbol(a.zax, JitSymbol::IdleStub);
+   a.call(a.zax);
+   a.loadGprCache();
+}
+
+static_assert(sizeof(ReturnStackEntry) == 16, "jit_push_return assumes 16 byte return stack entries");
+
+// Key of a return stack entry, the guest address in eax must have
+//   its upper 32 bits clear.
+static void
+jit_return_key(PPCEmuAssembler& a)
+{
+   a.movSymbol(a.zdx, JitSymbol::ReturnStackEpoch);
+   a.mov(a.edx, asmjit::X86Mem(a.zdx, 0, 4));
+   a.shl(a.zdx, 32);
+   a.or_(a.zdx, a.zax);
+}
+
+// Push the code for the return address of a call, so the matching
+//   bclr can jump straight back without going to the dispatcher.
+static void
+jit_push_return(PPCEmuAssembler& a, uint32_t nia)
+{
+   auto entry = a.entryLabels.find(nia);
+   if (entry == a.entryLabels.end()) {
+      return;
+   }
+
+   a.mov(a.eax, nia);
+   jit_return_key(a);
+
+   a.mov(a.ecx, a.ppcreturnStackTop);
+   a.inc(a.ecx);
+   a.and_(a.ecx, ReturnStackSize - 1);
+   a.mov(a.ppcreturnStackTop, a.ecx);
+   a.shl(a.ecx, 4);
+
+   a.mov(asmjit::X86Mem(a.state, a.zcx, 0, a.returnStackOffset, 8), a.zdx);
+   a.lea(a.zax, asmjit::x86::ptr(entry->second));
+   a.mov(asmjit::X86Mem(a.state, a.zcx, 0, a.returnStackOffset + 8, 8), a.zax);
+}
+
+// Jump to the top of the return stack if it is for the address in eax,
+//   falls through with eax preserved when it does not match.
+static void
+jit_pop_return(PPCEmuAssembler& a)
+{
+   asmjit::Label miss(a);
+   auto r8 = asmjit::x86::r8;
+
+   jit_return_key(a);
+
+   a.mov(a.ecx, a.ppcreturnStackTop);
+   a.mov(a.r8d, a.ecx);
+   a.shl(a.r8d, 4);
+   a.cmp(a.zdx, asmjit::X86Mem(a.state, r8, 0, a.returnStackOffset, 8));
+   a.jne(miss);
+
+   a.dec(a.ecx);
+   a.and_(a.ecx, ReturnStackSize - 1);
+   a.mov(a.ppcreturnStackTop, a.ecx);
+   a.jmp(asmjit::X86Mem(a.state, r8, 0, a.returnStackOffset + 8, 8));
+
+   a.bind(miss);
+}
+
 bool
 jit_b(PPCEmuAssembler& a, Instruction instr, uint32_t cia, const JumpLabelMap& jumpLabels)
 {
@@ -55,17 +179,20 @@ jit_b(PPCEmuAssembler& a, Instruction instr, uint32_t cia, const JumpLabelMap& j
       a.mov(a.eax, cia + 4u);
       a.mov(a.ppclr, a.eax);
 
-      a.mov(a.eax, nia);
-      a.jmp(asmjit::Ptr(cpu::jit::gFinaleFn));
+      jit_push_return(a, cia + 4);
+      jit_exit(a, nia);
       return true;
    }
 
    auto i = jumpLabels.find(nia);
    if (i != jumpLabels.end()) {
+      if (a.idleLoop) {
+         jit_idle(a);
+      }
+
       a.jmp(i->second);
    } else {
-      a.mov(a.eax, nia);
-      a.jmp(asmjit::Ptr(cpu::jit::gFinaleFn));
+      jit_exit(a, nia);
    }
 
    return true;
@@ -124,21 +251,42 @@ bcGeneric(PPCEmuAssembler& a, Instruction instr, uint32_t cia, const JumpLabelMa
    //   this if-block as we use a JMP instruction with
    //   early exit in the else block...
    if (flags & BcBranchCTR) {
+      if (instr.lk) {
+         jit_push_return(a, cia + 4);
+      }
+
       a.mov(a.eax, a.ppcctr);
       a.and_(a.eax, ~0x3);
-      a.jmp(asmjit::Ptr(cpu::jit::gFinaleFn));
+      a.flushGprCache();
+      a.movSymbol(a.zcx, JitSymbol::Finale);
+      a.jmp(a.zcx);
    } else if (flags & BcBranchLR) {
       a.mov(a.eax, a.ppclr);
       a.and_(a.eax, ~0x3);
-      a.jmp(asmjit::Ptr(cpu::jit::gFinaleFn));
+      a.flushGprCache();
+
+      if (!instr.lk) {
+         jit_pop_return(a);
+      }
+
+      a.movSymbol(a.zcx, JitSymbol::Finale);
+      a.jmp(a.zcx);
    } else {
       uint32_t nia = cia + sign_extend<16>(instr.bd << 2);
+
+      if (instr.lk) {
+         jit_push_return(a, cia + 4);
+      }
+
       auto i = jumpLabels.find(nia);
       if (i != jumpLabels.end()) {
+         if (a.idleLoop) {
+            jit_idle(a);
+         }
+
          a.jmp(i->second);
       } else {
-         a.mov(a.eax, nia);
-         a.jmp(asmjit::Ptr(cpu::jit::gFinaleFn));
+         jit_exit(a, nia);
       }
    }
 
@@ -0,0 +1,435 @@
+#include <fstream>
+#include <list>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "jit.h"
+#include "jit_insreg.h"
+#include "cpu/cpu_internal.h"
+#include "cpu/instructionid.h"
+#include "cpu/interpreter/interpreter_insreg.h"
+#include "mem/mem.h"
+#include "platform/platform_dir.h"
+#include "utils/binaryfile.h"
+#include "utils/crc32.h"
+#include "utils/log.h"
+
+namespace cpu
+{
+
+namespace jit
+{
+
+// Bump whenever the code generator or the file layout changes
+static const uint32_t CacheMagic = 0x54494A44; // 'DJIT'
+static const uint32_t CacheVersion = 10;
+
+// Options and host CPU features which change the generated code
+static uint32_t
+getCodeFlags()
+{
+   auto cpuInfo = asmjit::X86CpuInfo::getHost();
+
+   return (cpuInfo->hasFeature(asmjit::kX86CpuFeatureFMA3) ? 1 : 0)
+        | (cpu::isVirtualTime() ? 2 : 0)
+        | (cpu::hasTscTimeBase() ? 4 : 0);
+}
+
+/*
+A range of guest code, usually the .text section of a loaded module.
+Cached blocks are stored per region in a file keyed by the module name,
+its load address and the crc32 of its code after relocation.
+*/
+struct CodeRegion
+{
+   std::string name;
+   uint32_t start;
+   uint32_t end;
+   uint32_t crc;
+   bool dirty;
+   std::map<uint32_t, JitCachedBlock> blocks;
+};
+
+static std::string sCachePath;
+static std::list<CodeRegion> sRegions;
+static std::mutex sCacheMutex;
+
+void *
+getSymbolAddress(JitSymbol symbol, uint32_t index)
+{
+   switch (symbol) {
+   case JitSymbol::Finale:
+      return reinterpret_cast<void *>(gFinaleFn);
+   case JitSymbol::InterruptStub:
+      return reinterpret_cast<void *>(&jit_interrupt_stub);
+   case JitSymbol::FallbackCall:
+      return reinterpret_cast<void *>(cpu::interpreter::getInstructionHandler(static_cast<InstructionID>(index)));
+   case JitSymbol::FallbackCounter:
+      return getFallbackCounter(static_cast<InstructionID>(index));
+   case JitSymbol::KernelCallFn:
+   case JitSymbol::KernelCallData:
+   {
+      auto kc = cpu::getKernelCall(index);
+
+      if (!kc) {
+         return nullptr;
+      }
+
+      if (symbol == JitSymbol::KernelCallFn) {
+         return reinterpret_cast<void *>(kc->first);
+      } else {
+         return kc->second;
+      }
+   }
+   case JitSymbol::ReturnStackEpoch:
+      return &gReturnStackEpoch;
+   case JitSymbol::KernelCallStub:
+      return reinterpret_cast<void *>(&jit_kernel_call_stub);
+   case JitSymbol::IdleStub:
+      return reinterpret_cast<void *>(&jit_idle_stub);
+   case JitSymbol::TimeBase:
+      return &cpu::gTimeBase;
+   case JitSymbol::BreakpointStub:
+      return reinterpret_cast<void *>(&jit_breakpoint_stub);
+   default:
+      return nullptr;
+   }
+}
+
+static std::string
+getCacheFilename(const CodeRegion &region)
+{
+   return fmt::format("{}/{}_{:08x}_{:08x}.jit", sCachePath, region.name, region.start, region.crc);
+}
+
+static uint32_t
+guestCrc(uint32_t start, uint32_t end)
+{
+   return crc32(mem::translate(start), end - start);
+}
+
+static CodeRegion *
+findRegion(uint32_t addr)
+{
+   for (auto &region : sRegions) {
+      if (addr >= region.start && addr < region.end) {
+         return &region;
+      }
+   }
+
+   return nullptr;
+}
+
+template<typename Type>
+static void
+writeValue(std::ofstream &out, const Type &value)
+{
+   out.write(reinterpret_cast<const char *>(&value), sizeof(Type));
+}
+
+template<typename Type>
+static void
+appendValue(std::vector<char> &out, const Type &value)
+{
+   auto bytes = reinterpret_cast<const char *>(&value);
+   out.insert(out.end(), bytes, bytes + sizeof(Type));
+}
+
+// The file record of a block, it is followed by the record's crc32
+static void
+serialiseBlock(const JitCachedBlock &block, std::vector<char> &out)
+{
+   appendValue(out, block.start);
+   appendValue(out, block.end);
+   appendValue(out, block.crc);
+   appendValue(out, block.entry);
+
+   appendValue(out, static_cast<uint32_t>(block.targets.size()));
+
+   for (auto &target : block.targets) {
+      appendValue(out, target.first);
+      appendValue(out, target.second);
+   }
+
+   appendValue(out, static_cast<uint32_t>(block.exits.size()));
+
+   for (auto &exit : block.exits) {
+      appendValue(out, exit.target);
+      appendValue(out, exit.jump);
+      appendValue(out, exit.stub);
+   }
+
+   appendValue(out, static_cast<uint32_t>(block.relocs.size()));
+
+   for (auto &reloc : block.relocs) {
+      appendValue(out, reloc.offset);
+      appendValue(out, static_cast<uint32_t>(reloc.symbol));
+      appendValue(out, reloc.index);
+   }
+
+   appendValue(out, static_cast<uint32_t>(block.code.size()));
+   out.insert(out.end(), block.code.begin(), block.code.end());
+}
+
+// Everything placeBlock writes through must land inside the block's code,
+//   and its guest range inside the region it was loaded for.
+static bool
+isValidBlock(const CodeRegion &region, const JitCachedBlock &block)
+{
+   auto size = static_cast<uint64_t>(block.code.size());
+
+   if (block.start >= block.end || block.start < region.start || block.end > region.end) {
+      return false;
+   }
+
+   if (block.entry >= size) {
+      return false;
+   }
+
+   for (auto &target : block.targets) {
+      if (target.first < block.start || target.first >= block.end || target.second >= size) {
+         return false;
+      }
+   }
+
+   for (auto &exit : block.exits) {
+      if (static_cast<uint64_t>(exit.jump) + 5 > size || exit.stub >= size) {
+         return false;
+      }
+   }
+
+   for (auto &reloc : block.relocs) {
+      if (reloc.symbol >= JitSymbol::SymbolCount || static_cast<uint64_t>(reloc.offset) + 10 > size) {
+         return false;
+      }
+   }
+
+   return true;
+}
+
+// Read an element count, checking the rest of the file is large enough
+//   to hold that many elements before anything is allocated for them.
+static uint32_t
+readCount(BinaryFile &in, size_t elementSize)
+{
+   auto count = in.read<uint32_t>();
+   auto remaining = in.data().size() - in.tell();
+
+   if (count > remaining / elementSize) {
+      throw std::runtime_error(fmt::format("count {} runs past the end of the file", count));
+   }
+
+   return count;
+}
+
+static bool
+readCacheFile(CodeRegion &region)
+{
+   BinaryFile in;
+
+   if (!in.open(getCacheFilename(region))) {
+      return false;
+   }
+
+   try {
+      if (in.read<uint32_t>() != CacheMagic
+       || in.read<uint32_t>() != CacheVersion
+       || in.read<uint32_t>() != sizeof(ThreadState)
+       || in.read<uint32_t>() != static_cast<uint32_t>(InstructionID::InstructionCount)
+       || in.read<uint32_t>() != getCodeFlags()) {
+         gLog->warn("Ignoring out of date JIT cache for {}", region.name);
+         return false;
+      }
+
+      // Each block is at least its four fields, three counts, code size and checksum
+      auto blockCount = readCount(in, 9 * sizeof(uint32_t));
+      std::vector<char> record;
+
+      for (auto i = 0u; i < blockCount; ++i) {
+         JitCachedBlock block;
+         block.start = in.read<uint32_t>();
+         block.end = in.read<uint32_t>();
+         block.crc = in.read<uint32_t>();
+         block.entry = in.read<uint32_t>();
+
+         auto targetCount = readCount(in, 2 * sizeof(uint32_t));
+
+         for (auto j = 0u; j < targetCount; ++j) {
+            auto addr = in.read<uint32_t>();
+            block.targets[addr] = in.read<uint32_t>();
+         }
+
+         block.exits.resize(readCount(in, 3 * sizeof(uint32_t)));
+
+         for (auto &exit : block.exits) {
+            exit.target = in.read<uint32_t>();
+            exit.jump = in.read<uint32_t>();
+            exit.stub = in.read<uint32_t>();
+         }
+
+         block.relocs.resize(readCount(in, 3 * sizeof(uint32_t)));
+
+         for (auto &reloc : block.relocs) {
+            reloc.offset = in.read<uint32_t>();
+            reloc.symbol = static_cast<JitSymbol>(in.read<uint32_t>());
+            reloc.index = in.read<uint32_t>();
+         }
+
+         auto code = in.readView(in.read<uint32_t>());
+         block.code.assign(code.begin(), code.end());
+
+         auto checksum = in.read<uint32_t>();
+         record.clear();
+         serialiseBlock(block, record);
+
+         if (crc32(record.data(), record.size()) != checksum) {
+            throw std::runtime_error(fmt::format("checksum mismatch in block {:08x}", block.start));
+         }
+
+         if (!isValidBlock(region, block)) {
+            throw std::runtime_error(fmt::format("invalid block {:08x}", block.start));
+         }
+
+         region.blocks.emplace(block.start, std::move(block));
+      }
+   } catch (std::exception &e) {
+      gLog->warn("Ignoring corrupt JIT cache for {}: {}", region.name, e.what());
+      region.blocks.clear();
+      return false;
+   }
+
+   gLog->info("Loaded {} cached JIT blocks for {}", region.blocks.size(), region.name);
+   return true;
+}
+
+static bool
+writeCacheFile(const CodeRegion &region)
+{
+   std::ofstream out { getCacheFilename(region), std::ofstream::out | std::ofstream::binary };
+
+   if (!out.is_open()) {
+      return false;
+   }
+
+   writeValue(out, CacheMagic);
+   writeValue(out, CacheVersion);
+   writeValue(out, static_cast<uint32_t>(sizeof(ThreadState)));
+   writeValue(out, static_cast<uint32_t>(InstructionID::InstructionCount));
+   writeValue(out, getCodeFlags());
+   writeValue(out, static_cast<uint32_t>(region.blocks.size()));
+
+   std::vector<char> record;
+
+   for (auto &itr : region.blocks) {
+      record.clear();
+      serialiseBlock(itr.second, record);
+      out.write(record.data(), record.size());
+      writeValue(out, crc32(record.data(), record.size()));
+   }
+
+   return out.good();
+}
+
+void
+setCachePath(const std::string &path)
+{
+   std::unique_lock<std::mutex> lock(sCacheMutex);
+   sCachePath = path;
+}
+
+void
+registerCodeRegion(const std::string &name, uint32_t start, uint32_t end)
+{
+   std::unique_lock<std::mutex> lock(sCacheMutex);
+
+   if (sCachePath.empty() || end <= start) {
+      return;
+   }
+
+   CodeRegion region;
+   region.name = name;
+   region.start = start;
+   region.end = end;
+   region.crc = guestCrc(start, end);
+   region.dirty = false;
+
+   readCacheFile(region);
+   sRegions.emplace_back(std::move(region));
+}
+
+// Returns the cached block for addr if the guest code it was compiled
+//   from is unchanged, blocks are only validated when first used.
+const JitCachedBlock *
+findCachedBlock(uint32_t addr)
+{
+   std::unique_lock<std::mutex> lock(sCacheMutex);
+   auto region = findRegion(addr);
+
+   if (!region) {
+      return nullptr;
+   }
+
+   auto itr = region->blocks.find(addr);
+
+   if (itr == region->blocks.end()) {
+      return nullptr;
+   }
+
+   auto &block = itr->second;
+
+   if (block.end > region->end || guestCrc(block.start, block.end) != block.crc) {
+      gLog->debug("Discarding stale cached JIT block {:08x}", addr);
+      region->blocks.erase(itr);
+      region->dirty = true;
+      return nullptr;
+   }
+
+   return &block;
+}
+
+void
+addCachedBlock(const JitCachedBlock &block)
+{
+   std::unique_lock<std::mutex> lock(sCacheMutex);
+   auto region = findRegion(block.start);
+
+   if (!region || block.end > region->end) {
+      return;
+   }
+
+   auto &cached = region->blocks[block.start];
+   cached = block;
+   cached.crc = guestCrc(block.start, block.end);
+   region->dirty = true;
+}
+
+void
+saveCache()
+{
+   std::unique_lock<std::mutex> lock(sCacheMutex);
+
+   if (sCachePath.empty()) {
+      return;
+   }
+
+   platform::createDirectory(sCachePath);
+
+   for (auto &region : sRegions) {
+      if (!region.dirty) {
+         continue;
+      }
+
+      if (!writeCacheFile(region)) {
+         gLog->warn("Failed to write JIT cache for {}", region.name);
+         continue;
+      }
+
+      region.dirty = false;
+   }
+}
+
+} // namespace jit
+
+} // namespace cpu
@@ -0,0 +1,110 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+
+namespace cpu
+{
+
+namespace jit
+{
+
+using JitCode = void *;
+
+/**
+ * Flat two level lookup table from guest address to compiled code.
+ *
+ * The first level is indexed by guest page, the second level holds one
+ * code pointer per instruction in that page. Lookups are lock free and
+ * may run on any core, insert / clear must only be called by a single
+ * writer at a time.
+ */
+class JitCodeTable
+{
+   static const unsigned PageShift = 12;
+   static const size_t PageCount = size_t { 1 } << (32 - PageShift);
+   static const size_t PageEntries = size_t { 1 } << (PageShift - 2);
+
+   struct Page
+   {
+      Page()
+      {
+         for (auto &entry : entries) {
+            entry.store(nullptr, std::memory_order_relaxed);
+         }
+      }
+
+      std::atomic<JitCode> entries[PageEntries];
+   };
+
+public:
+   ~JitCodeTable()
+   {
+      clear();
+   }
+
+   // Returns the code for address, or nullptr if there is none
+   JitCode
+   find(uint32_t address) const
+   {
+      auto page = mPages[address >> PageShift].load(std::memory_order_acquire);
+
+      if (!page) {
+         return nullptr;
+      }
+
+      return page->entries[getIndex(address)].load(std::memory_order_acquire);
+   }
+
+   void
+   insert(uint32_t address, JitCode code)
+   {
+      auto &pagePtr = mPages[address >> PageShift];
+      auto page = pagePtr.load(std::memory_order_relaxed);
+
+      if (!page) {
+         page = new Page();
+         pagePtr.store(page, std::memory_order_release);
+      }
+
+      page->entries[getIndex(address)].store(code, std::memory_order_release);
+   }
+
+   // Remove every entry, the pages are kept so other threads may still
+   //   be reading from the table.
+   void
+   reset()
+   {
+      for (auto &pagePtr : mPages) {
+         auto page = pagePtr.load(std::memory_order_relaxed);
+
+         if (page) {
+            for (auto &entry : page->entries) {
+               entry.store(nullptr, std::memory_order_release);
+            }
+         }
+      }
+   }
+
+   // Not safe to call whilst another thread may be reading from the table
+   void
+   clear()
+   {
+      for (auto &pagePtr : mPages) {
+         delete pagePtr.exchange(nullptr, std::memory_order_relaxed);
+      }
+   }
+
+private:
+   static size_t
+   getIndex(uint32_t address)
+   {
+      return (address & ((1u << PageShift) - 1)) >> 2;
+   }
+
+private:
+   std::atomic<Page *> mPages[PageCount] = { };
+};
+
+} // namespace jit
+
+} // namespace cpu
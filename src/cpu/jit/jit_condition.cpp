@@ -75,7 +75,7 @@ cmpGeneric(PPCEmuAssembler& a, Instruction instr)
    a.or_(a.edx, a.eax);
 
    // Perform Comparison
-   a.mov(a.eax, a.ppcgpr[instr.rA]);
+   a.loadGpr(a.eax, instr.rA);
 
    if (flags & CmpImmediate) {
       if (std::is_signed<Type>::value) {
@@ -84,7 +84,7 @@ cmpGeneric(PPCEmuAssembler& a, Instruction instr)
          a.mov(a.ecx, instr.uimm);
       }
    } else {
-      a.mov(a.ecx, a.ppcgpr[instr.rB]);
+      a.loadGpr(a.ecx, instr.rB);
    }
 
    a.cmp(a.eax, a.ecx);
@@ -311,7 +311,7 @@ static bool
 mfcr(PPCEmuAssembler& a, Instruction instr)
 {
    a.mov(a.eax, a.ppccr);
-   a.mov(a.ppcgpr[instr.rD], a.eax);
+   a.storeGpr(instr.rD, a.eax);
    return true;
 }
 
@@ -327,7 +327,7 @@ mtcrf(PPCEmuAssembler& a, Instruction instr)
       }
    }
 
-   a.mov(a.eax, a.ppcgpr[instr.rS]);
+   a.loadGpr(a.eax, instr.rS);
    a.and_(a.eax, mask);
    a.mov(a.ecx, a.ppccr);
    a.and_(a.ecx, ~mask);
@@ -14,6 +14,11 @@ namespace jit
 
 static uint64_t sFallbackCalls[static_cast<size_t>(InstructionID::InstructionCount)] = { 0 };
 
+uint64_t *getFallbackCounter(InstructionID id)
+{
+   return &sFallbackCalls[static_cast<size_t>(id)];
+}
+
 bool jit_fallback(PPCEmuAssembler& a, Instruction instr)
 {
    auto data = gInstructionTable.decode(instr);
@@ -23,18 +28,33 @@ bool jit_fallback(PPCEmuAssembler& a, Instruction instr)
    }
 
    if (TRACK_FALLBACK_CALLS) {
-      a.mov(a.zax, asmjit::Ptr(reinterpret_cast<intptr_t>(&sFallbackCalls[static_cast<uint32_t>(data->id)])));
+      a.movSymbol(a.zax, JitSymbol::FallbackCounter, static_cast<uint32_t>(data->id));
       a.lock();
       a.inc(asmjit::X86Mem(a.zax, 0));
    }
 
+   a.flushGprCache();
    a.mov(a.zcx, a.state);
    a.mov(a.edx, (uint32_t)instr);
-   a.call(asmjit::Ptr(fptr));
+   a.movSymbol(a.zax, JitSymbol::FallbackCall, static_cast<uint32_t>(data->id));
+   a.call(a.zax);
+   a.loadGprCache();
 
    return true;
 }
 
+// Call the interpreter only when a runtime guard jumps to fallback, the
+//   natively emitted code falls through straight past it.
+bool jit_fallback_guarded(PPCEmuAssembler& a, Instruction instr, const asmjit::Label& fallback)
+{
+   asmjit::Label done(a);
+   a.jmp(done);
+   a.bind(fallback);
+   jit_fallback(a, instr);
+   a.bind(done);
+   return true;
+}
+
 } // namespace jit
 
 } // namespace cpu
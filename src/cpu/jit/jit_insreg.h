@@ -23,6 +23,13 @@ void registerPairedInstructions();
 void registerSystemInstructions();
 
 bool jit_fallback(PPCEmuAssembler& a, Instruction instr);
+bool jit_fallback_guarded(PPCEmuAssembler& a, Instruction instr, const asmjit::Label& fallback);
+uint64_t *getFallbackCounter(InstructionID id);
+
+void jit_interrupt_stub(ThreadState *state, uint64_t region);
+void jit_idle_stub(ThreadState *state, uint64_t region);
+void jit_kernel_call_stub(ThreadState *state, void *data, KernelCallFn fn, uint64_t region);
+void jit_breakpoint_stub(ThreadState *state, uint32_t cia, uint64_t region);
 
 } // namespace jit
 
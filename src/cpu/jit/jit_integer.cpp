@@ -8,10 +8,14 @@ namespace cpu
 namespace jit
 {
 
-// Update cr0 with value
+// Update cr0 with value, skipped when nothing reads cr0 before it is next written
 static void
 updateConditionRegister(PPCEmuAssembler& a, const asmjit::X86GpReg& value, const asmjit::X86GpReg& tmp, const asmjit::X86GpReg& tmp2)
 {
+   if (!a.cr0Live) {
+      return;
+   }
+
    auto crtarget = 0;
    auto crshift = (7 - crtarget) * 4;
 
@@ -70,7 +74,7 @@ addGeneric(PPCEmuAssembler& a, Instruction instr)
    bool recordCond = false;
 
    if (flags & AddCarry) {
-      recordCarry = true;
+      recordCarry = a.carryLive;
    }
 
    if (flags & AddAlwaysRecord) {
@@ -89,7 +93,7 @@ addGeneric(PPCEmuAssembler& a, Instruction instr)
    if ((flags & AddZeroRA) && instr.rA == 0) {
       a.mov(a.eax, 0);
    } else {
-      a.mov(a.eax, a.ppcgpr[instr.rA]);
+      a.loadGpr(a.eax, instr.rA);
    }
 
    if (flags & AddSubtract) {
@@ -103,7 +107,7 @@ addGeneric(PPCEmuAssembler& a, Instruction instr)
    } else if (flags & AddToMinusOne) {
       a.mov(a.ecx, -1);
    } else {
-      a.mov(a.ecx, a.ppcgpr[instr.rB]);
+      a.loadGpr(a.ecx, instr.rB);
    }
 
    if (flags & AddShifted) {
@@ -161,7 +165,7 @@ addGeneric(PPCEmuAssembler& a, Instruction instr)
       a.mov(a.ppcxer, a.edx);
    }
 
-   a.mov(a.ppcgpr[instr.rD], a.eax);
+   a.storeGpr(instr.rD, a.eax);
 
    if (recordCond) {
       updateConditionRegister(a, a.eax, a.ecx, a.edx);
@@ -238,12 +242,12 @@ template<unsigned flags>
 static bool
 andGeneric(PPCEmuAssembler& a, Instruction instr)
 {
-   a.mov(a.eax, a.ppcgpr[instr.rS]);
+   a.loadGpr(a.eax, instr.rS);
 
    if (flags & AndImmediate) {
       a.mov(a.ecx, instr.uimm);
    } else {
-      a.mov(a.ecx, a.ppcgpr[instr.rB]);
+      a.loadGpr(a.ecx, instr.rB);
    }
 
    if (flags & AndShifted) {
@@ -256,7 +260,7 @@ andGeneric(PPCEmuAssembler& a, Instruction instr)
 
    a.and_(a.eax, a.ecx);
 
-   a.mov(a.ppcgpr[instr.rA], a.eax);
+   a.storeGpr(instr.rA, a.eax);
 
    if (flags & AndAlwaysRecord) {
       updateConditionRegister(a, a.eax, a.ecx, a.edx);
@@ -299,7 +303,7 @@ cntlzw(PPCEmuAssembler& a, Instruction instr)
 {
    asmjit::Label lblZero(a);
 
-   a.mov(a.ecx, a.ppcgpr[instr.rS]);
+   a.loadGpr(a.ecx, instr.rS);
    a.mov(a.eax, 32);
 
    a.cmp(a.ecx, 0);
@@ -312,7 +316,7 @@ cntlzw(PPCEmuAssembler& a, Instruction instr)
    a.sub(a.eax, a.edx);
 
    a.bind(lblZero);
-   a.mov(a.ppcgpr[instr.rA], a.eax);
+   a.storeGpr(instr.rA, a.eax);
 
    if (instr.rc) {
       updateConditionRegister(a, a.eax, a.ecx, a.edx);
@@ -346,13 +350,13 @@ divwu(PPCEmuAssembler& a, Instruction instr)
 static bool
 eqv(PPCEmuAssembler& a, Instruction instr)
 {
-   a.mov(a.eax, a.ppcgpr[instr.rS]);
-   a.mov(a.ecx, a.ppcgpr[instr.rB]);
+   a.loadGpr(a.eax, instr.rS);
+   a.loadGpr(a.ecx, instr.rB);
 
    a.xor_(a.eax, a.ecx);
    a.not_(a.eax);
 
-   a.mov(a.ppcgpr[instr.rA], a.eax);
+   a.storeGpr(instr.rA, a.eax);
 
    if (instr.rc) {
       updateConditionRegister(a, a.eax, a.ecx, a.edx);
@@ -365,11 +369,11 @@ eqv(PPCEmuAssembler& a, Instruction instr)
 static bool
 extsb(PPCEmuAssembler& a, Instruction instr)
 {
-   a.mov(a.eax, a.ppcgpr[instr.rS]);
+   a.loadGpr(a.eax, instr.rS);
 
    a.movsx(a.eax, a.eax.r8());
 
-   a.mov(a.ppcgpr[instr.rA], a.eax);
+   a.storeGpr(instr.rA, a.eax);
 
    if (instr.rc) {
       updateConditionRegister(a, a.eax, a.ecx, a.edx);
@@ -382,11 +386,11 @@ extsb(PPCEmuAssembler& a, Instruction instr)
 static bool
 extsh(PPCEmuAssembler& a, Instruction instr)
 {
-   a.mov(a.eax, a.ppcgpr[instr.rS]);
+   a.loadGpr(a.eax, instr.rS);
 
    a.movsx(a.eax, a.eax.r16());
 
-   a.mov(a.ppcgpr[instr.rA], a.eax);
+   a.storeGpr(instr.rA, a.eax);
 
    if (instr.rc) {
       updateConditionRegister(a, a.eax, a.ecx, a.edx);
@@ -409,18 +413,18 @@ template<unsigned flags>
 static bool
 mulSignedGeneric(PPCEmuAssembler& a, Instruction instr)
 {
-   a.mov(a.eax, a.ppcgpr[instr.rA]);
+   a.loadGpr(a.eax, instr.rA);
 
    if (flags & MulImmediate) {
       a.mov(a.ecx, sign_extend<16>(instr.simm));
    } else {
-      a.mov(a.ecx, a.ppcgpr[instr.rB]);
+      a.loadGpr(a.ecx, instr.rB);
    }
 
    a.imul(a.ecx);
 
    if (flags & MulLow) {
-      a.mov(a.ppcgpr[instr.rD], a.eax);
+      a.storeGpr(instr.rD, a.eax);
 
       if (flags & MulCheckRecord) {
          if (instr.rc) {
@@ -428,7 +432,7 @@ mulSignedGeneric(PPCEmuAssembler& a, Instruction instr)
          }
       }
    } else if (flags & MulHigh) {
-      a.mov(a.ppcgpr[instr.rD], a.edx);
+      a.storeGpr(instr.rD, a.edx);
 
       if (flags & MulCheckRecord) {
          if (instr.rc) {
@@ -447,18 +451,18 @@ template<unsigned flags>
 static bool
 mulUnsignedGeneric(PPCEmuAssembler& a, Instruction instr)
 {
-   a.mov(a.eax, a.ppcgpr[instr.rA]);
+   a.loadGpr(a.eax, instr.rA);
 
    if (flags & MulImmediate) {
       a.mov(a.ecx, sign_extend<16>(instr.simm));
    } else {
-      a.mov(a.ecx, a.ppcgpr[instr.rB]);
+      a.loadGpr(a.ecx, instr.rB);
    }
 
    a.mul(a.ecx);
 
    if (flags & MulLow) {
-      a.mov(a.ppcgpr[instr.rD], a.eax);
+      a.storeGpr(instr.rD, a.eax);
 
       if (flags & MulCheckRecord) {
          if (instr.rc) {
@@ -466,7 +470,7 @@ mulUnsignedGeneric(PPCEmuAssembler& a, Instruction instr)
          }
       }
    } else if (flags & MulHigh) {
-      a.mov(a.ppcgpr[instr.rD], a.edx);
+      a.storeGpr(instr.rD, a.edx);
 
       if (flags & MulCheckRecord) {
          if (instr.rc) {
@@ -508,13 +512,13 @@ mullw(PPCEmuAssembler& a, Instruction instr)
 static bool
 nand(PPCEmuAssembler& a, Instruction instr)
 {
-   a.mov(a.eax, a.ppcgpr[instr.rS]);
-   a.mov(a.ecx, a.ppcgpr[instr.rB]);
+   a.loadGpr(a.eax, instr.rS);
+   a.loadGpr(a.ecx, instr.rB);
 
    a.and_(a.eax, a.ecx);
    a.not_(a.eax);
 
-   a.mov(a.ppcgpr[instr.rA], a.eax);
+   a.storeGpr(instr.rA, a.eax);
 
    if (instr.rc) {
       updateConditionRegister(a, a.eax, a.ecx, a.edx);
@@ -527,9 +531,9 @@ nand(PPCEmuAssembler& a, Instruction instr)
 static bool
 neg(PPCEmuAssembler& a, Instruction instr)
 {
-   a.mov(a.eax, a.ppcgpr[instr.rA]);
+   a.loadGpr(a.eax, instr.rA);
    a.neg(a.eax);
-   a.mov(a.ppcgpr[instr.rD], a.eax);
+   a.storeGpr(instr.rD, a.eax);
 
    if (instr.oe) {
       a.mov(a.ecx, 0);
@@ -558,13 +562,13 @@ neg(PPCEmuAssembler& a, Instruction instr)
 static bool
 nor(PPCEmuAssembler& a, Instruction instr)
 {
-   a.mov(a.eax, a.ppcgpr[instr.rS]);
-   a.mov(a.ecx, a.ppcgpr[instr.rB]);
+   a.loadGpr(a.eax, instr.rS);
+   a.loadGpr(a.ecx, instr.rB);
 
    a.or_(a.eax, a.ecx);
    a.not_(a.eax);
 
-   a.mov(a.ppcgpr[instr.rA], a.eax);
+   a.storeGpr(instr.rA, a.eax);
 
    if (instr.rc) {
       updateConditionRegister(a, a.eax, a.ecx, a.edx);
@@ -587,12 +591,12 @@ template<unsigned flags>
 static bool
 orGeneric(PPCEmuAssembler& a, Instruction instr)
 {
-   a.mov(a.eax, a.ppcgpr[instr.rS]);
+   a.loadGpr(a.eax, instr.rS);
 
    if (flags & OrImmediate) {
       a.mov(a.ecx, instr.uimm);
    } else {
-      a.mov(a.ecx, a.ppcgpr[instr.rB]);
+      a.loadGpr(a.ecx, instr.rB);
    }
 
    if (flags & OrShifted) {
@@ -604,7 +608,7 @@ orGeneric(PPCEmuAssembler& a, Instruction instr)
    }
 
    a.or_(a.eax, a.ecx);
-   a.mov(a.ppcgpr[instr.rA], a.eax);
+   a.storeGpr(instr.rA, a.eax);
 
    if (flags & OrAlwaysRecord) {
       updateConditionRegister(a, a.eax, a.ecx, a.edx);
@@ -653,12 +657,12 @@ template<unsigned flags>
 static bool
 rlwGeneric(PPCEmuAssembler& a, Instruction instr)
 {
-   a.mov(a.eax, a.ppcgpr[instr.rS]);
+   a.loadGpr(a.eax, instr.rS);
 
    if (flags & RlwImmediate) {
       a.rol(a.eax, instr.sh);
    } else {
-      a.mov(a.ecx, a.ppcgpr[instr.rB]);
+      a.loadGpr(a.ecx, instr.rB);
       a.and_(a.ecx, 0x1f);
       a.rol(a.eax, a.ecx.r8());
    }
@@ -669,12 +673,12 @@ rlwGeneric(PPCEmuAssembler& a, Instruction instr)
       a.and_(a.eax, m);
    } else if (flags & RlwInsert) {
       a.and_(a.eax, m);
-      a.mov(a.ecx, a.ppcgpr[instr.rA]);
+      a.loadGpr(a.ecx, instr.rA);
       a.and_(a.ecx, ~m);
       a.or_(a.eax, a.ecx);
    }
 
-   a.mov(a.ppcgpr[instr.rA], a.eax);
+   a.storeGpr(instr.rA, a.eax);
 
    if (instr.rc) {
       updateConditionRegister(a, a.eax, a.ecx, a.edx);
@@ -716,7 +720,7 @@ template<unsigned flags>
 static bool
 shiftLogical(PPCEmuAssembler& a, Instruction instr)
 {
-   a.mov(a.eax, a.ppcgpr[instr.rS]);
+   a.loadGpr(a.eax, instr.rS);
 
    if (flags & ShiftImmediate) {
       if (flags & ShiftLeft) {
@@ -727,7 +731,7 @@ shiftLogical(PPCEmuAssembler& a, Instruction instr)
 		 throw;
       }
    } else {
-      a.mov(a.ecx, a.ppcgpr[instr.rB]);
+      a.loadGpr(a.ecx, instr.rB);
 
       if (flags & ShiftLeft) {
          a.shl(a.zax, a.ecx.r8());
@@ -738,7 +742,7 @@ shiftLogical(PPCEmuAssembler& a, Instruction instr)
       }
    }
 
-   a.mov(a.ppcgpr[instr.rA], a.eax);
+   a.storeGpr(instr.rA, a.eax);
 
    if (instr.rc) {
       updateConditionRegister(a, a.eax, a.ecx, a.edx);
@@ -770,7 +774,8 @@ shiftArithmetic(PPCEmuAssembler& a, Instruction instr)
       throw;
    }
 
-   a.movsxd(a.zax, a.ppcgpr[instr.rS]);
+   a.loadGpr(a.eax, instr.rS);
+   a.movsxd(a.zax, a.eax);
    a.mov(a.edx, a.eax);
 
    if (flags & ShiftImmediate) {
@@ -778,7 +783,7 @@ shiftArithmetic(PPCEmuAssembler& a, Instruction instr)
 
       a.shl(a.zdx, 32 - instr.sh);
    } else {
-      a.mov(a.ecx, a.ppcgpr[instr.rB]);
+      a.loadGpr(a.ecx, instr.rB);
       a.mov(a.r8d, a.ecx);
 
       a.sar(a.zax, a.ecx.r8());
@@ -787,17 +792,19 @@ shiftArithmetic(PPCEmuAssembler& a, Instruction instr)
       a.shr(a.zdx, a.ecx.r8());
    }
 
-   a.test(a.edx, a.eax);
-   a.mov(a.ecx, 0);
-   a.setnz(a.ecx.r8());
-   a.shl(a.ecx, XERegisterBits::CarryShift);
+   if (a.carryLive) {
+      a.test(a.edx, a.eax);
+      a.mov(a.ecx, 0);
+      a.setnz(a.ecx.r8());
+      a.shl(a.ecx, XERegisterBits::CarryShift);
 
-   a.mov(a.edx, a.ppcxer);
-   a.and_(a.edx, ~XERegisterBits::Carry);
-   a.or_(a.edx, a.ecx);
-   a.mov(a.ppcxer, a.edx);
+      a.mov(a.edx, a.ppcxer);
+      a.and_(a.edx, ~XERegisterBits::Carry);
+      a.or_(a.edx, a.ecx);
+      a.mov(a.ppcxer, a.edx);
+   }
 
-   a.mov(a.ppcgpr[instr.rA], a.eax);
+   a.storeGpr(instr.rA, a.eax);
 
    if (instr.rc) {
       updateConditionRegister(a, a.eax, a.ecx, a.edx);
@@ -867,12 +874,12 @@ template<unsigned flags>
 static bool
 xorGeneric(PPCEmuAssembler& a, Instruction instr)
 {
-   a.mov(a.eax, a.ppcgpr[instr.rS]);
+   a.loadGpr(a.eax, instr.rS);
 
    if (flags & XorImmediate) {
       a.mov(a.ecx, instr.uimm);
    } else {
-      a.mov(a.ecx, a.ppcgpr[instr.rB]);
+      a.loadGpr(a.ecx, instr.rB);
    }
 
    if (flags & XorShifted) {
@@ -880,7 +887,7 @@ xorGeneric(PPCEmuAssembler& a, Instruction instr)
    }
 
    a.xor_(a.eax, a.ecx);
-   a.mov(a.ppcgpr[instr.rA], a.eax);
+   a.storeGpr(instr.rA, a.eax);
 
    if (flags & XorCheckRecord) {
       if (instr.rc) {
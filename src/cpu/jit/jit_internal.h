@@ -1,7 +1,10 @@
 #pragma once
+#include <cstring>
 #include <map>
+#include <vector>
 #include <asmjit/asmjit.h>
 #include "../cpu.h"
+#include "jit_codetable.h"
 
 namespace cpu
 {
@@ -14,14 +17,60 @@ Register Assignments:
 RAX . Scratch
 RCX . Scratch
 RDX . Scratch
-RDI . Scratch
+RDI . Current instruction address (JIT_DEBUG)
 RSI . mem::base()
 RBX . ThreadState*
-RBP .
+RBP . Cached PPCGPR
 RSP . Emu Stack Pointer.
-R8-R15 . PPCGPR Storage
+R8-R9 . Scratch
+R12 . Interrupt flag address
+R13-R15 . Cached PPCGPR
 */
 
+/*
+A branch out of a block to a known guest address, emitted as a patchable
+jmp rel32 which initially targets an exit stub at the end of the block.
+Once the target block is compiled the jmp is patched to enter it directly.
+*/
+struct JitExit
+{
+   uint32_t target;
+   asmjit::Label jump;
+   asmjit::Label stub;
+};
+
+/*
+Host addresses referenced from generated code. Blocks never embed these
+directly, they load them with movSymbol so that the block can be saved
+to the translation cache and relocated when loaded in another process.
+*/
+enum class JitSymbol : uint32_t
+{
+   Finale,
+   InterruptStub,
+   FallbackCall,
+   FallbackCounter,
+   KernelCallFn,
+   KernelCallData,
+   ReturnStackEpoch,
+   KernelCallStub,
+   IdleStub,
+   CodeRegion,       // Code arena region of the block, filled in by placeBlock
+   TimeBase,         // cpu::gTimeBase, read by mftb
+   BreakpointStub,
+   SymbolCount,      // Not a symbol, used to validate cached relocations
+};
+
+void *
+getSymbolAddress(JitSymbol symbol, uint32_t index);
+
+struct JitReloc
+{
+   asmjit::Label label;
+   JitSymbol symbol;
+   uint32_t index;
+};
+
 class PPCEmuAssembler : public asmjit::X86Assembler
 {
 private:
@@ -57,6 +106,8 @@ public:
 #define PPCTSReg(mm) asmjit::X86Mem(zbx, (int32_t)offsetof2(ThreadState, mm), sizeof(ThreadState::mm))
       for (auto i = 0; i < 32; ++i) {
          ppcgpr[i] = PPCTSReg(gpr[i]);
+         gprCached[i] = false;
+         gprDirty[i] = false;
       }
 
       for (auto i = 0; i < 32; ++i) {
@@ -75,9 +126,23 @@ public:
          ppcgqr[i] = PPCTSReg(gqr[i].value);
       }
 
+      gqrKnown = false;
+      cr0Live = true;
+      carryLive = true;
+      addressKnown = false;
+      address = 0;
+      rawLoad = false;
+      rawStore = false;
+      idleLoop = false;
+      virtualTime = false;
+      pendingTime = 0;
+
       ppcreserve = PPCTSReg(reserve);
       ppcreserveAddress = PPCTSReg(reserveAddress);
       ppcreserveData = PPCTSReg(reserveData);
+
+      ppcreturnStackTop = PPCTSReg(returnStackTop);
+      returnStackOffset = (int32_t)offsetof2(ThreadState, returnStack);
 #undef PPCTSReg
    }
 
@@ -90,6 +155,87 @@ public:
       }
    }
 
+   // Read guest GPR n, from its cached host register if it has one
+   void loadGpr(const asmjit::X86GpReg& reg, uint32_t n)
+   {
+      if (gprCached[n]) {
+         mov(reg, gprCache[n]);
+      } else {
+         mov(reg, ppcgpr[n]);
+      }
+   }
+
+   // Write guest GPR n, GPRs which are cached but not expected to be
+   //   written by this block are written through to ThreadState so
+   //   that flushGprCache never has to store them.
+   void storeGpr(uint32_t n, const asmjit::X86GpReg& reg)
+   {
+      if (gprCached[n]) {
+         mov(gprCache[n], reg);
+
+         if (!gprDirty[n]) {
+            mov(ppcgpr[n], reg);
+         }
+      } else {
+         mov(ppcgpr[n], reg);
+      }
+   }
+
+   // Load every cached GPR from ThreadState, used on block entry and
+   //   after anything which may have modified ThreadState::gpr.
+   void loadGprCache()
+   {
+      for (auto i = 0; i < 32; ++i) {
+         if (gprCached[i]) {
+            mov(gprCache[i], ppcgpr[i]);
+         }
+      }
+   }
+
+   // Write back every cached GPR this block might have modified, used
+   //   before leaving the block or calling out to the interpreter.
+   void flushGprCache()
+   {
+      for (auto i = 0; i < 32; ++i) {
+         if (gprCached[i] && gprDirty[i]) {
+            mov(ppcgpr[i], gprCache[i]);
+         }
+      }
+   }
+
+   // Load the host address of symbol into reg, always emitted as a
+   //   mov r64, imm64 so the immediate can be relocated.
+   void movSymbol(const asmjit::X86GpReg& reg, JitSymbol symbol, uint32_t index = 0)
+   {
+      auto value = reinterpret_cast<uint64_t>(getSymbolAddress(symbol, index));
+      auto regIndex = reg.getRegIndex();
+      uint8_t code[10];
+
+      code[0] = 0x48 | (regIndex >= 8 ? 0x01 : 0x00);
+      code[1] = 0xB8 + (regIndex & 7);
+      std::memcpy(code + 2, &value, sizeof(value));
+
+      JitReloc reloc;
+      reloc.label = asmjit::Label(*this);
+      reloc.symbol = symbol;
+      reloc.index = index;
+
+      bind(reloc.label);
+      embed(code, sizeof(code));
+      relocs.push_back(reloc);
+   }
+
+   bool hasGprCache() const
+   {
+      for (auto i = 0; i < 32; ++i) {
+         if (gprCached[i]) {
+            return true;
+         }
+      }
+
+      return false;
+   }
+
    asmjit::X86GpReg state;
    asmjit::X86GpReg membase;
    asmjit::X86GpReg interruptAddr;
@@ -119,6 +265,47 @@ public:
    asmjit::X86Mem ppcreserve;
    asmjit::X86Mem ppcreserveAddress;
    asmjit::X86Mem ppcreserveData;
+
+   asmjit::X86Mem ppcreturnStackTop;
+   int32_t returnStackOffset;
+
+   // GQR values when the block was compiled, psq_l / psq_st are
+   //   specialised for these and guard that they still hold.
+   bool gqrKnown;
+   uint32_t gqrValues[8];
+
+   // Whether the cr0 / xer[ca] result of the instruction being generated
+   //   may be read before it is overwritten, when false it is not stored.
+   bool cr0Live;
+   bool carryLive;
+
+   // Load / store effective address known at compile time
+   bool addressKnown;
+   uint32_t address;
+
+   // Copy between a load and the following store, the value is passed in
+   //   eax in memory byte order, see fuseCopies.
+   bool rawLoad;
+   bool rawStore;
+
+   // The instruction being generated is the branch of an idle loop
+   bool idleLoop;
+
+   // Count instructions into the core's virtual time, pendingTime is the
+   //   number run since the last count was added, see jit_flush_time.
+   bool virtualTime;
+   uint32_t pendingTime;
+
+   // Guest GPRs held in host registers for the block being generated
+   asmjit::X86GpReg gprCache[32];
+   bool gprCached[32];
+   bool gprDirty[32];
+
+   std::vector<JitExit> exits;
+   std::vector<JitReloc> relocs;
+
+   // Labels to enter the block at a jump target from outside the block
+   std::map<uint32_t, asmjit::Label> entryLabels;
 };
 
 template<typename T, typename Z>
@@ -127,7 +314,6 @@ T asmjit_cast(Z* base, size_t offset = 0)
    return reinterpret_cast<T>(((char*)base) + offset);
 }
 
-using JitCode = void *;
 using JitCall = uint32_t(*)(ThreadState*, cpu::CoreState*, JitCode);
 using JitFinale = JitCall;
 
@@ -136,19 +322,99 @@ using JumpLabelMap = std::map<uint32_t, asmjit::Label>;
 extern JitCall gCallFn;
 extern JitFinale gFinaleFn;
 
+// Changes whenever blocks are removed, return stack entries from an
+//   older epoch never match so they cannot jump into stale code.
+extern std::atomic<uint32_t> gReturnStackEpoch;
+
+// Bracket a call out of generated code which may switch fibers, region
+//   is the JitSymbol::CodeRegion value of the calling block.
+void
+beginCallout(ThreadState *state, uint64_t region);
+
+void
+endCallout(ThreadState *state, uint64_t region);
+
+void
+jit_exit(PPCEmuAssembler& a, uint32_t target);
+
+void
+jit_flush_time(PPCEmuAssembler& a);
+
+struct JitLink
+{
+   uint32_t target;
+   uint8_t *jump;
+   uint8_t *stub;
+};
+
+/*
+Position independent description of a compiled block, everything is an
+offset from the start of the code so it can be written to and loaded
+from the translation cache.
+*/
+struct JitCachedExit
+{
+   uint32_t target;
+   uint32_t jump;
+   uint32_t stub;
+};
+
+struct JitCachedReloc
+{
+   uint32_t offset;
+   JitSymbol symbol;
+   uint32_t index;
+};
+
+struct JitCachedBlock
+{
+   uint32_t start;
+   uint32_t end;
+   uint32_t crc;     // crc32 of the guest instructions
+   uint32_t entry;
+   std::map<uint32_t, uint32_t> targets;
+   std::vector<JitCachedExit> exits;
+   std::vector<JitCachedReloc> relocs;
+   std::vector<uint8_t> code;
+};
+
+const JitCachedBlock *
+findCachedBlock(uint32_t addr);
+
+void
+addCachedBlock(const JitCachedBlock &block);
+
 struct JitBlock
 {
    JitBlock(uint32_t _start) {
       start = _start;
       end = _start;
       entry = nullptr;
+      code = nullptr;
+      codeSize = 0;
+      region = 0;
+      gqrKnown = false;
+      breakpoints = false;
    }
 
    uint32_t start;
    uint32_t end;
 
+   // Host code of the block and the arena region it was placed in
+   uint8_t *code;
+   size_t codeSize;
+   uint32_t region;
+
+   bool gqrKnown;
+   uint32_t gqr[8];
+
+   // Contains debugger breakpoint traps, so must not be saved to the cache
+   bool breakpoints;
+
    JitCode entry;
    std::map<uint32_t, JitCode> targets;
+   std::vector<JitLink> links;
+   JitCachedBlock layout;
 };
 
 } // namespace jit
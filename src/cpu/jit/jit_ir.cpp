@@ -0,0 +1,617 @@
+#include <algorithm>
+#include "jit_ir.h"
+#include "jit_internal.h"
+#include "../cpu_internal.h"
+#include "mem/mem.h"
+#include "utils/bitutils.h"
+
+namespace cpu
+{
+
+namespace jit
+{
+
+static const uint32_t AllGprs = 0xFFFFFFFF;
+
+int
+getGprField(Instruction instr, Field field)
+{
+   switch (field) {
+   case Field::rA:
+      return instr.rA;
+   case Field::rB:
+      return instr.rB;
+   case Field::rD:
+      return instr.rD;
+   case Field::rS:
+      return instr.rS;
+   default:
+      return -1;
+   }
+}
+
+static bool
+hasField(const std::vector<Field>& fields, Field field)
+{
+   return std::find(fields.begin(), fields.end(), field) != fields.end();
+}
+
+static uint32_t
+getGprMask(Instruction instr, const std::vector<Field>& fields)
+{
+   uint32_t mask = 0;
+
+   for (auto field : fields) {
+      auto gpr = getGprField(instr, field);
+
+      if (gpr >= 0) {
+         mask |= 1u << gpr;
+      }
+   }
+
+   return mask;
+}
+
+// Instructions which leave the block or may change any guest state
+static bool
+isExit(const InstructionData *data)
+{
+   if (!data) {
+      return true;
+   }
+
+   switch (data->id) {
+   case InstructionID::b:
+   case InstructionID::bc:
+   case InstructionID::bcctr:
+   case InstructionID::bclr:
+   case InstructionID::kc:
+   case InstructionID::sc:
+   case InstructionID::rfi:
+   case InstructionID::tw:
+   case InstructionID::twi:
+      return true;
+   default:
+      return false;
+   }
+}
+
+// Instructions touching more GPRs than their fields describe
+static bool
+hasHiddenGprs(InstructionID id)
+{
+   switch (id) {
+   case InstructionID::lmw:
+   case InstructionID::stmw:
+   case InstructionID::lswi:
+   case InstructionID::lswx:
+   case InstructionID::stswi:
+   case InstructionID::stswx:
+   case InstructionID::psq_lu:
+   case InstructionID::psq_lux:
+   case InstructionID::psq_stu:
+   case InstructionID::psq_stux:
+      return true;
+   default:
+      return false;
+   }
+}
+
+// Loads and stores emitted by loadGeneric / storeGeneric, which can use
+//   a constant effective address
+static bool
+isSimpleMemoryAccess(InstructionID id)
+{
+   switch (id) {
+   case InstructionID::lbz:
+   case InstructionID::lbzu:
+   case InstructionID::lbzx:
+   case InstructionID::lbzux:
+   case InstructionID::lha:
+   case InstructionID::lhau:
+   case InstructionID::lhax:
+   case InstructionID::lhaux:
+   case InstructionID::lhz:
+   case InstructionID::lhzu:
+   case InstructionID::lhzx:
+   case InstructionID::lhzux:
+   case InstructionID::lwz:
+   case InstructionID::lwzu:
+   case InstructionID::lwzx:
+   case InstructionID::lwzux:
+   case InstructionID::lhbrx:
+   case InstructionID::lwbrx:
+   case InstructionID::lwarx:
+   case InstructionID::lfs:
+   case InstructionID::lfsu:
+   case InstructionID::lfsx:
+   case InstructionID::lfsux:
+   case InstructionID::lfd:
+   case InstructionID::lfdu:
+   case InstructionID::lfdx:
+   case InstructionID::lfdux:
+   case InstructionID::stb:
+   case InstructionID::stbu:
+   case InstructionID::stbx:
+   case InstructionID::stbux:
+   case InstructionID::sth:
+   case InstructionID::sthu:
+   case InstructionID::sthx:
+   case InstructionID::sthux:
+   case InstructionID::stw:
+   case InstructionID::stwu:
+   case InstructionID::stwx:
+   case InstructionID::stwux:
+   case InstructionID::sthbrx:
+   case InstructionID::stwbrx:
+   case InstructionID::stfs:
+   case InstructionID::stfsu:
+   case InstructionID::stfsx:
+   case InstructionID::stfsux:
+   case InstructionID::stfd:
+   case InstructionID::stfdu:
+   case InstructionID::stfdx:
+   case InstructionID::stfdux:
+   case InstructionID::stfiwx:
+      return true;
+   default:
+      return false;
+   }
+}
+
+// Instructions with no effect besides writing one GPR, and cr0 / xer
+//   when the record or overflow forms are used
+static bool
+isPure(InstructionID id)
+{
+   switch (id) {
+   case InstructionID::add:
+   case InstructionID::addi:
+   case InstructionID::addis:
+   case InstructionID::and_:
+   case InstructionID::andc:
+   case InstructionID::cntlzw:
+   case InstructionID::eqv:
+   case InstructionID::extsb:
+   case InstructionID::extsh:
+   case InstructionID::mulhw:
+   case InstructionID::mulhwu:
+   case InstructionID::mulli:
+   case InstructionID::mullw:
+   case InstructionID::nand:
+   case InstructionID::neg:
+   case InstructionID::nor:
+   case InstructionID::or_:
+   case InstructionID::orc:
+   case InstructionID::ori:
+   case InstructionID::oris:
+   case InstructionID::rlwimi:
+   case InstructionID::rlwinm:
+   case InstructionID::rlwnm:
+   case InstructionID::slw:
+   case InstructionID::srw:
+   case InstructionID::subf:
+   case InstructionID::xor_:
+   case InstructionID::xori:
+   case InstructionID::xoris:
+      return true;
+   default:
+      return false;
+   }
+}
+
+// Branch back to the start of an idle loop within the block
+static bool
+isIdleBranch(const JitIrInst& inst, uint32_t start)
+{
+   uint32_t target;
+
+   if (!inst.data) {
+      return false;
+   } else if (inst.data->id == InstructionID::b) {
+      target = inst.cia + sign_extend<26>(inst.instr.li << 2);
+   } else if (inst.data->id == InstructionID::bc) {
+      target = inst.cia + sign_extend<16>(inst.instr.bd << 2);
+   } else {
+      return false;
+   }
+
+   return target >= start && target <= inst.cia && isIdleLoop(target, inst.cia);
+}
+
+void
+buildIr(JitIrBlock& ir, const JitBlock& block)
+{
+   ir.start = block.start;
+   ir.end = block.end;
+   ir.insts.clear();
+
+   for (auto cia = block.start; cia < block.end; cia += 4) {
+      JitIrInst inst;
+      inst.cia = cia;
+      inst.instr = mem::read<Instruction>(cia);
+      inst.data = gInstructionTable.decode(inst.instr);
+      inst.target = block.targets.find(cia) != block.targets.end();
+      inst.liveFlags = FlagAll;
+      inst.liveGprs = AllGprs;
+      inst.dead = false;
+      inst.hasResult = false;
+      inst.dest = -1;
+      inst.result = 0;
+      inst.hasAddress = false;
+      inst.address = 0;
+      inst.rawLoad = false;
+      inst.rawStore = false;
+      inst.idleLoop = isIdleBranch(inst, block.start);
+      ir.insts.push_back(inst);
+   }
+}
+
+// GPR values known at compile time
+struct ConstantState
+{
+   uint32_t known;
+   uint32_t values[32];
+
+   bool get(uint32_t gpr, uint32_t& value) const
+   {
+      value = values[gpr];
+      return !!(known & (1u << gpr));
+   }
+
+   void set(uint32_t gpr, uint32_t value)
+   {
+      known |= 1u << gpr;
+      values[gpr] = value;
+   }
+};
+
+// Compute the result of inst if all of its inputs are known
+static bool
+foldConstant(JitIrInst& inst, const ConstantState& state)
+{
+   auto instr = inst.instr;
+   auto simm = static_cast<uint32_t>(sign_extend<16, int32_t>(instr.simm));
+   uint32_t a, b;
+
+   switch (inst.data->id) {
+   case InstructionID::addi:
+   case InstructionID::addis:
+      if (instr.rA == 0) {
+         a = 0;
+      } else if (!state.get(instr.rA, a)) {
+         return false;
+      }
+
+      if (inst.data->id == InstructionID::addis) {
+         simm <<= 16;
+      }
+
+      inst.dest = instr.rD;
+      inst.result = a + simm;
+      return true;
+   case InstructionID::ori:
+   case InstructionID::oris:
+   case InstructionID::xori:
+   case InstructionID::xoris:
+      if (!state.get(instr.rS, a)) {
+         return false;
+      }
+
+      b = instr.uimm;
+
+      if (inst.data->id == InstructionID::oris || inst.data->id == InstructionID::xoris) {
+         b <<= 16;
+      }
+
+      inst.dest = instr.rA;
+
+      if (inst.data->id == InstructionID::ori || inst.data->id == InstructionID::oris) {
+         inst.result = a | b;
+      } else {
+         inst.result = a ^ b;
+      }
+      return true;
+   case InstructionID::or_:
+   case InstructionID::and_:
+   case InstructionID::xor_:
+      if (instr.rc || !state.get(instr.rS, a) || !state.get(instr.rB, b)) {
+         return false;
+      }
+
+      inst.dest = instr.rA;
+
+      if (inst.data->id == InstructionID::or_) {
+         inst.result = a | b;
+      } else if (inst.data->id == InstructionID::and_) {
+         inst.result = a & b;
+      } else {
+         inst.result = a ^ b;
+      }
+      return true;
+   case InstructionID::add:
+   case InstructionID::subf:
+      if (instr.rc || instr.oe || !state.get(instr.rA, a) || !state.get(instr.rB, b)) {
+         return false;
+      }
+
+      inst.dest = instr.rD;
+
+      if (inst.data->id == InstructionID::add) {
+         inst.result = a + b;
+      } else {
+         inst.result = b - a;
+      }
+      return true;
+   case InstructionID::rlwinm:
+      if (instr.rc || !state.get(instr.rS, a)) {
+         return false;
+      }
+
+      inst.dest = instr.rA;
+      inst.result = bit_rotate_left(a, instr.sh) & make_ppc_bitmask(instr.mb, instr.me);
+      return true;
+   default:
+      return false;
+   }
+}
+
+// Work out the effective address of a load / store if its inputs are known
+static bool
+foldAddress(JitIrInst& inst, const ConstantState& state)
+{
+   auto instr = inst.instr;
+   auto update = hasField(inst.data->write, Field::rA);
+   uint32_t base, offset;
+
+   if (instr.rA == 0 && !update) {
+      base = 0;
+   } else if (!state.get(instr.rA, base)) {
+      return false;
+   }
+
+   if (hasField(inst.data->read, Field::rB)) {
+      if (!state.get(instr.rB, offset)) {
+         return false;
+      }
+   } else {
+      offset = static_cast<uint32_t>(sign_extend<16, int32_t>(instr.d));
+   }
+
+   inst.address = base + offset;
+   return true;
+}
+
+// Forward pass tracking which GPRs hold values known at compile time,
+//   lis / ori pairs and the loads and stores using them become constants.
+static void
+propagateConstants(JitIrBlock& ir)
+{
+   ConstantState state;
+   state.known = 0;
+
+   for (auto &inst : ir.insts) {
+      if (inst.target) {
+         state.known = 0;
+      }
+
+      if (isExit(inst.data) || hasHiddenGprs(inst.data->id)) {
+         state.known = 0;
+         continue;
+      }
+
+      inst.hasResult = foldConstant(inst, state);
+
+      if (isSimpleMemoryAccess(inst.data->id)) {
+         inst.hasAddress = foldAddress(inst, state);
+      }
+
+      state.known &= ~getGprMask(inst.instr, inst.data->write);
+
+      if (inst.hasResult) {
+         state.set(inst.dest, inst.result);
+      } else if (inst.hasAddress && hasField(inst.data->write, Field::rA)) {
+         if (!hasField(inst.data->write, Field::rD) || inst.instr.rD != inst.instr.rA) {
+            state.set(inst.instr.rA, inst.address);
+         }
+      }
+   }
+}
+
+// Which of cr0 and xer[ca] instr may read and which it always overwrites
+static void
+getFlagUsage(const JitIrInst& inst, uint8_t& read, uint8_t& write)
+{
+   auto instr = inst.instr;
+   auto data = inst.data;
+   read = 0;
+   write = 0;
+
+   if (isExit(data)) {
+      read = FlagAll;
+      return;
+   }
+
+   switch (data->id) {
+   // Reads or partially writes the whole register
+   case InstructionID::mfcr:
+   case InstructionID::mtcrf:
+   case InstructionID::mfspr:
+   case InstructionID::mtspr:
+      read = FlagAll;
+      return;
+   case InstructionID::cmp:
+   case InstructionID::cmpi:
+   case InstructionID::cmpl:
+   case InstructionID::cmpli:
+      if (instr.crfD == 0) {
+         write |= FlagCr0;
+      }
+      break;
+   default:
+      break;
+   }
+
+   if (hasField(data->read, Field::bi)
+    || hasField(data->read, Field::crbA)
+    || hasField(data->read, Field::crbB)
+    || hasField(data->read, Field::crfS)) {
+      read |= FlagCr0;
+   }
+
+   if (hasField(data->read, Field::XERC)
+    || hasField(data->read, Field::XERO)) {
+      read |= FlagCarry;
+   }
+
+   // Only integer record forms write cr0, floating point ones write cr1
+   auto writesGpr = hasField(data->write, Field::rD) || hasField(data->write, Field::rA);
+
+   if (hasField(data->flags, Field::ARC)
+    || (writesGpr && hasField(data->flags, Field::rc) && instr.rc)) {
+      write |= FlagCr0;
+   }
+
+   if (hasField(data->write, Field::XERC) && !(read & FlagCarry)) {
+      write |= FlagCarry;
+   }
+}
+
+// Backward pass finding which cr0 and xer[ca] results may be read before
+//   being overwritten, every flag is live when leaving the block.
+static void
+eliminateDeadFlags(JitIrBlock& ir)
+{
+   uint8_t live = FlagAll;
+
+   for (auto i = ir.insts.rbegin(); i != ir.insts.rend(); ++i) {
+      uint8_t read, write;
+      getFlagUsage(*i, read, write);
+      i->liveFlags = live;
+      live = (live & ~write) | read;
+   }
+}
+
+// Backward pass removing instructions whose GPR result is never read,
+//   every GPR is live when leaving the block.
+static void
+eliminateDeadCode(JitIrBlock& ir)
+{
+   auto live = AllGprs;
+
+   for (auto i = ir.insts.rbegin(); i != ir.insts.rend(); ++i) {
+      auto &inst = *i;
+      inst.liveGprs = live;
+
+      if (isExit(inst.data) || hasHiddenGprs(inst.data->id)) {
+         live = AllGprs;
+         continue;
+      }
+
+      auto instr = inst.instr;
+      auto data = inst.data;
+      auto written = getGprMask(instr, data->write);
+
+      if (isPure(data->id)
+       && !(live & written)
+       && !(hasField(data->flags, Field::oe) && instr.oe)
+       && !(hasField(data->flags, Field::rc) && instr.rc && (inst.liveFlags & FlagCr0))) {
+         inst.dead = true;
+         continue;
+      }
+
+      live &= ~written;
+
+      if (inst.hasResult) {
+         // Emitted as a move of the constant, reads nothing
+      } else if (inst.hasAddress) {
+         if (hasField(data->read, Field::rS)) {
+            live |= 1u << instr.rS;
+         }
+      } else {
+         live |= getGprMask(instr, data->read);
+      }
+   }
+}
+
+static bool
+getCopySize(InstructionID id, bool store, unsigned& size)
+{
+   switch (id) {
+   case InstructionID::lhz:
+   case InstructionID::lhzu:
+   case InstructionID::lhzx:
+   case InstructionID::lhzux:
+      size = 2;
+      return !store;
+   case InstructionID::lwz:
+   case InstructionID::lwzu:
+   case InstructionID::lwzx:
+   case InstructionID::lwzux:
+      size = 4;
+      return !store;
+   case InstructionID::sth:
+   case InstructionID::sthu:
+      size = 2;
+      return store;
+   case InstructionID::stw:
+   case InstructionID::stwu:
+      size = 4;
+      return store;
+   default:
+      return false;
+   }
+}
+
+// A load immediately stored elsewhere whose register is then dead can skip
+//   both byte swaps and the register write.
+static void
+fuseCopies(JitIrBlock& ir)
+{
+   for (auto i = 0u; i + 1 < ir.insts.size(); ++i) {
+      auto &load = ir.insts[i];
+      auto &store = ir.insts[i + 1];
+      unsigned loadSize, storeSize;
+
+      if (load.dead || store.dead || store.target
+       || isExit(load.data) || isExit(store.data)
+       || !getCopySize(load.data->id, false, loadSize)
+       || !getCopySize(store.data->id, true, storeSize)
+       || loadSize != storeSize) {
+         continue;
+      }
+
+      auto gpr = load.instr.rD;
+
+      if (store.instr.rS != gpr
+       || store.instr.rA == gpr
+       || load.instr.rA == gpr
+       || (store.liveGprs & (1u << gpr))) {
+         continue;
+      }
+
+      load.rawLoad = true;
+      store.rawStore = true;
+      ++i;
+   }
+}
+
+void
+optimiseIr(JitIrBlock& ir, bool breakpoints)
+{
+   propagateConstants(ir);
+
+   // A fused copy keeps its value in eax across the breakpoint call, and
+   //   the debugger would see the results which were left out.
+   if (breakpoints) {
+      return;
+   }
+
+   eliminateDeadFlags(ir);
+   eliminateDeadCode(ir);
+   fuseCopies(ir);
+}
+
+} // namespace jit
+
+} // namespace cpu
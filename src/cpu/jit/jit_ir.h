@@ -0,0 +1,87 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include "../instruction.h"
+#include "../instructiondata.h"
+
+namespace cpu
+{
+
+namespace jit
+{
+
+struct JitBlock;
+
+enum JitFlagBits : uint8_t
+{
+   FlagCr0 = 1 << 0,
+   FlagCarry = 1 << 1,
+   FlagAll = FlagCr0 | FlagCarry,
+};
+
+/*
+Block level representation sitting between decode and code generation.
+
+Every guest instruction of the block keeps its own entry so the per opcode
+emitters can still be used, the optimisation passes annotate entries with
+what they learnt about the values flowing between them:
+ - constant propagation, results and effective addresses known at compile time
+ - dead flag elimination, cr0 / xer[ca] results nobody reads
+ - dead code elimination, instructions whose GPR result nobody reads
+ - copy fusion, load then store of the same value without byte swapping
+*/
+struct JitIrInst
+{
+   uint32_t cia;
+   Instruction instr;
+   InstructionData *data;
+
+   // Another path may jump straight to this instruction
+   bool target;
+
+   // Flags and GPRs which may be read after this instruction
+   uint8_t liveFlags;
+   uint32_t liveGprs;
+
+   // Nothing reads the result, no code is emitted for it
+   bool dead;
+
+   // The result written to GPR dest is always constant
+   bool hasResult;
+   int dest;
+   uint32_t result;
+
+   // The effective address of this load / store is always constant
+   bool hasAddress;
+   uint32_t address;
+
+   // Load leaves the value in memory byte order in eax for the following
+   //   store instead of writing it to rD, which nothing else reads.
+   bool rawLoad;
+   bool rawStore;
+
+   // Branch back to the start of an idle loop, see cpu::isIdleLoop
+   bool idleLoop;
+};
+
+struct JitIrBlock
+{
+   uint32_t start;
+   uint32_t end;
+   std::vector<JitIrInst> insts;
+};
+
+int
+getGprField(Instruction instr, Field field);
+
+void
+buildIr(JitIrBlock& ir, const JitBlock& block);
+
+// With breakpoints only the passes which keep every instruction's guest
+//   state intact are run, the debugger may stop before any of them.
+void
+optimiseIr(JitIrBlock& ir, bool breakpoints);
+
+} // namespace jit
+
+} // namespace cpu
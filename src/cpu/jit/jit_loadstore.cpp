@@ -1,6 +1,8 @@
 #include <cassert>
 #include <algorithm>
+#include <limits>
 #include "jit_insreg.h"
+#include "utils/bit_cast.h"
 #include "utils/bitutils.h"
 
 namespace cpu
@@ -24,18 +26,23 @@ template<typename Type, unsigned flags = 0>
 static bool
 loadGeneric(PPCEmuAssembler& a, Instruction instr)
 {
-   if ((flags & LoadZeroRA) && instr.rA == 0) {
-      a.mov(a.ecx, 0u);
+   if (a.addressKnown) {
+      a.mov(a.ecx, a.address);
    } else {
-      a.mov(a.ecx, a.ppcgpr[instr.rA]);
-   }
+      if ((flags & LoadZeroRA) && instr.rA == 0) {
+         a.mov(a.ecx, 0u);
+      } else {
+         a.loadGpr(a.ecx, instr.rA);
+      }
 
-   if (flags & LoadIndexed) {
-      a.add(a.ecx, a.ppcgpr[instr.rB]);
-   } else {
-      auto x = sign_extend<16, int32_t>(instr.d);
-      if (x != 0) {
-         a.add(a.ecx, x);
+      if (flags & LoadIndexed) {
+         a.loadGpr(a.eax, instr.rB);
+         a.add(a.ecx, a.eax);
+      } else {
+         auto x = sign_extend<16, int32_t>(instr.d);
+         if (x != 0) {
+            a.add(a.ecx, x);
+         }
       }
    }
 
@@ -48,12 +55,12 @@ loadGeneric(PPCEmuAssembler& a, Instruction instr)
    } else if (sizeof(Type) == 2) {
       a.mov(a.eax, 0);
       a.mov(a.eax.r16(), asmjit::X86Mem(a.zdx, 0));
-      if (!(flags & LoadByteReverse)) {
+      if (!(flags & LoadByteReverse) && !a.rawLoad) {
          a.xchg(a.eax.r8Hi(), a.eax.r8Lo());
       }
    } else if (sizeof(Type) == 4) {
       a.mov(a.eax, asmjit::X86Mem(a.zdx, 0));
-      if (!(flags & LoadByteReverse)) {
+      if (!(flags & LoadByteReverse) && !a.rawLoad) {
          a.bswap(a.eax);
       }
    } else if (sizeof(Type) == 8) {
@@ -80,21 +87,21 @@ loadGeneric(PPCEmuAssembler& a, Instruction instr)
          a.movsx(a.eax, a.eax.r16());
       }
 
-      a.mov(a.ppcgpr[instr.rD], a.eax);
+      // The following store takes the value straight from eax
+      if (!a.rawLoad) {
+         a.storeGpr(instr.rD, a.eax);
+      }
    }
 
    if (flags & LoadReserve) {
+      // Reserve the value we loaded, a second read could see a newer one
       a.mov(a.ppcreserve, 1u);
       a.mov(a.ppcreserveAddress, a.ecx);
-      a.mov(a.zdx, a.ecx);
-      a.add(a.zdx, a.membase);
-      a.mov(a.eax, asmjit::X86Mem(a.zdx, 0));
-      a.bswap(a.eax);
       a.mov(a.ppcreserveData, a.eax);
    }
 
    if (flags & LoadUpdate) {
-      a.mov(a.ppcgpr[instr.rA], a.ecx);
+      a.storeGpr(instr.rA, a.ecx);
    }
 
    return true;
@@ -270,7 +277,7 @@ lmw(PPCEmuAssembler& a, Instruction instr)
    auto o = sign_extend<16, int32_t>(instr.d);
 
    if (instr.rA) {
-      a.mov(a.ecx, a.ppcgpr[instr.rA]);
+      a.loadGpr(a.ecx, instr.rA);
       if (o != 0) {
          a.add(a.ecx, o);
       }
@@ -283,7 +290,7 @@ lmw(PPCEmuAssembler& a, Instruction instr)
    for (int r = instr.rD, d = 0; r <= 31; ++r, d += 4) {
       a.mov(a.eax, asmjit::X86Mem(a.zcx, d));
       a.bswap(a.eax);
-      a.mov(a.ppcgpr[r], a.eax);
+      a.storeGpr(r, a.eax);
    }
 
    return true;
@@ -320,7 +327,6 @@ enum StoreFlags
    StoreUpdate = 1 << 0, // Save EA in rA
    StoreIndexed = 1 << 1, // Use rB instead of d
    StoreByteReverse = 1 << 2, // Swap Bytes
-   StoreConditional = 1 << 3, // lward/stwcx Conditional
    StoreZeroRA = 1 << 4, // Use 0 instead of r0
    StoreFloatAsInteger = 1 << 5, // stfiwx
 };
@@ -329,22 +335,20 @@ template<typename Type, unsigned flags = 0>
 static bool
 storeGeneric(PPCEmuAssembler& a, Instruction instr)
 {
-   if (flags & StoreConditional) {
-      // Early out for if statement below.
-      return jit_fallback(a, instr);
-   }
-
-   if ((flags & StoreZeroRA) && instr.rA == 0) {
+   if (a.addressKnown) {
+      a.mov(a.ecx, a.address);
+   } else if ((flags & StoreZeroRA) && instr.rA == 0) {
       if (flags & StoreIndexed) {
-         a.mov(a.ecx, a.ppcgpr[instr.rB]);
+         a.loadGpr(a.ecx, instr.rB);
       } else {
          a.mov(a.ecx, sign_extend<16, int32_t>(instr.d));
       }
    } else {
-      a.mov(a.ecx, a.ppcgpr[instr.rA]);
+      a.loadGpr(a.ecx, instr.rA);
 
       if (flags & StoreIndexed) {
-         a.add(a.ecx, a.ppcgpr[instr.rB]);
+         a.loadGpr(a.eax, instr.rB);
+         a.add(a.ecx, a.eax);
       } else {
          auto x = sign_extend<16, int32_t>(instr.d);
          if (x != 0) {
@@ -353,21 +357,6 @@ storeGeneric(PPCEmuAssembler& a, Instruction instr)
       }
    }
 
-   if (flags & StoreConditional) {
-      /*
-      state->cr.cr0 = state->xer.so ? ConditionRegisterFlag::SummaryOverflow : 0;
-
-      if (state->reserve) {
-      // Store is succesful, clear reserve bit and set CR0[EQ]
-      state->cr.cr0 |= ConditionRegisterFlag::Equal;
-      state->reserve = false;
-      } else {
-      // Reserve bit is not set, do not write.
-      return;
-      }
-      */
-   }
-
    a.mov(a.zdx, a.zcx);
    a.add(a.zdx, a.membase);
 
@@ -383,19 +372,12 @@ storeGeneric(PPCEmuAssembler& a, Instruction instr)
          assert(sizeof(Type) == 8);
          a.mov(a.zax, a.ppcfpr[instr.rS]);
       }
-   } else {
-      if (sizeof(Type) == 1) {
-         a.mov(a.eax.r8(), a.ppcgpr[instr.rS]);
-      } else if (sizeof(Type) == 2) {
-         a.mov(a.eax.r16(), a.ppcgpr[instr.rS]);
-      } else if (sizeof(Type) == 4) {
-         a.mov(a.eax, a.ppcgpr[instr.rS]);
-      } else {
-         assert(0);
-      }
+   } else if (!a.rawStore) {
+      assert(sizeof(Type) <= 4);
+      a.loadGpr(a.eax, instr.rS);
    }
 
-   if (!(flags & StoreByteReverse)) {
+   if (!(flags & StoreByteReverse) && !a.rawStore) {
       if (sizeof(Type) == 1) {
          // Inverted reverse logic means we have
          //    to check for this but do nothing.
@@ -423,7 +405,7 @@ storeGeneric(PPCEmuAssembler& a, Instruction instr)
    }
 
    if (flags & StoreUpdate) {
-      a.mov(a.ppcgpr[instr.rA], a.ecx);
+      a.storeGpr(instr.rA, a.ecx);
    }
 
    return true;
@@ -513,10 +495,49 @@ stwbrx(PPCEmuAssembler& a, Instruction instr)
    return storeGeneric<uint32_t, StoreZeroRA | StoreByteReverse | StoreIndexed>(a, instr);
 }
 
+// Store conditional, the reserved word is checked and written with a
+//   single lock cmpxchg so a write from another core in between fails
+//   the store. A reservation for a different address always fails.
 static bool
 stwcx(PPCEmuAssembler& a, Instruction instr)
 {
-   return storeGeneric<uint32_t, StoreZeroRA | StoreConditional | StoreIndexed>(a, instr);
+   const auto crshift = 7 * 4;
+   asmjit::Label done(a);
+
+   if (instr.rA == 0) {
+      a.loadGpr(a.ecx, instr.rB);
+   } else {
+      a.loadGpr(a.ecx, instr.rA);
+      a.loadGpr(a.eax, instr.rB);
+      a.add(a.ecx, a.eax);
+   }
+
+   // cr0 = xer[so], with eq set below if the store succeeds
+   a.mov(a.r8d, a.ppccr);
+   a.and_(a.r8d, ~(0xF << crshift));
+   a.mov(a.edx, a.ppcxer);
+   a.and_(a.edx, XERegisterBits::StickyOV);
+   a.shiftTo(a.edx, XERegisterBits::StickyOVShift, crshift + ConditionRegisterFlag::SummaryOverflowShift);
+   a.or_(a.r8d, a.edx);
+
+   a.cmp(a.ppcreserve, 0);
+   a.je(done);
+   a.cmp(a.ecx, a.ppcreserveAddress);
+   a.jne(done);
+
+   a.mov(a.eax, a.ppcreserveData);
+   a.bswap(a.eax);
+   a.loadGpr(a.edx, instr.rS);
+   a.bswap(a.edx);
+   a.lock();
+   a.cmpxchg(asmjit::X86Mem(a.membase, a.zcx, 0, 0, 4), a.edx);
+   a.jne(done);
+   a.or_(a.r8d, ConditionRegisterFlag::Equal << crshift);
+
+   a.bind(done);
+   a.mov(a.ppcreserve, 0u);
+   a.mov(a.ppccr, a.r8d);
+   return true;
 }
 
 static bool
@@ -581,7 +602,7 @@ stmw(PPCEmuAssembler& a, Instruction instr)
    auto o = sign_extend<16, int32_t>(instr.d);
 
    if (instr.rA) {
-      a.mov(a.ecx, a.ppcgpr[instr.rA]);
+      a.loadGpr(a.ecx, instr.rA);
       if (o != 0) {
          a.add(a.ecx, o);
       }
@@ -592,7 +613,7 @@ stmw(PPCEmuAssembler& a, Instruction instr)
    a.add(a.zcx, a.membase);
 
    for (int r = instr.rS, d = 0; r <= 31; ++r, d += 4) {
-      a.mov(a.eax, a.ppcgpr[r]);
+      a.loadGpr(a.eax, r);
       a.bswap(a.eax);
       a.mov(asmjit::X86Mem(a.zcx, d), a.eax);
    }
@@ -633,11 +654,177 @@ enum PsqLoadFlags
    PsqLoadIndexed = 1 << 2,
 };
 
+// GQR fields read by psq_l and psq_st
+static const uint32_t GqrLoadMask = 0x3F070000;
+static const uint32_t GqrStoreMask = 0x00003F07;
+
+static bool
+isKnownQuantizedType(QuantizedDataType type)
+{
+   switch (type) {
+   case QuantizedDataType::Floating:
+   case QuantizedDataType::Unsigned8:
+   case QuantizedDataType::Unsigned16:
+   case QuantizedDataType::Signed8:
+   case QuantizedDataType::Signed16:
+      return true;
+   default:
+      return false;
+   }
+}
+
+static uint32_t
+getQuantizedSize(QuantizedDataType type)
+{
+   switch (type) {
+   case QuantizedDataType::Unsigned8:
+   case QuantizedDataType::Signed8:
+      return 1;
+   case QuantizedDataType::Unsigned16:
+   case QuantizedDataType::Signed16:
+      return 2;
+   default:
+      return 4;
+   }
+}
+
+// 2^exp for a sign extended GQR scale field, exact so multiplying
+//   by it matches the std::ldexp used by quantize / dequantize.
+static uint64_t
+getQuantizedScale(int exp)
+{
+   return static_cast<uint64_t>(1023 + exp) << 52;
+}
+
+static int
+getQuantizedExponent(uint32_t scale)
+{
+   int exp = static_cast<int>(scale);
+   exp -= (exp & 32) << 1;  // Sign extend.
+   return exp;
+}
+
+// Guard that gqr[i] still holds the fields this code was specialised for,
+//   then leave the psq effective address in ecx and host address in rdx.
+static void
+psqPrologue(PPCEmuAssembler& a, Instruction instr, uint32_t i, uint32_t mask, bool zeroRA, bool indexed, const asmjit::Label& fallback)
+{
+   a.mov(a.eax, a.ppcgqr[i]);
+   a.and_(a.eax, mask);
+   a.cmp(a.eax, a.gqrValues[i] & mask);
+   a.jne(fallback);
+
+   if (zeroRA && instr.rA == 0) {
+      a.mov(a.ecx, 0u);
+   } else {
+      a.loadGpr(a.ecx, instr.rA);
+   }
+
+   if (indexed) {
+      a.loadGpr(a.eax, instr.rB);
+      a.add(a.ecx, a.eax);
+   } else {
+      auto x = sign_extend<12, int32_t>(instr.qd);
+      if (x != 0) {
+         a.add(a.ecx, x);
+      }
+   }
+
+   a.mov(a.zdx, a.zcx);
+   a.add(a.zdx, a.membase);
+}
+
+// Load one dequantized element at [rdx + offset] into reg
+static void
+psqLoadElement(PPCEmuAssembler& a, QuantizedDataType type, int exp, int32_t offset, const asmjit::X86XmmReg& reg, const asmjit::Label& fallback)
+{
+   if (type == QuantizedDataType::Floating) {
+      a.mov(a.eax, asmjit::X86Mem(a.zdx, offset));
+      a.bswap(a.eax);
+
+      // Signalling NaNs must keep their payload, leave those to the interpreter
+      a.mov(a.r8d, a.eax);
+      a.and_(a.r8d, 0x7F800000);
+      a.cmp(a.r8d, 0x7F800000);
+      a.je(fallback);
+
+      a.movd(reg, a.eax);
+      a.cvtss2sd(reg, reg);
+      return;
+   }
+
+   switch (type) {
+   case QuantizedDataType::Unsigned8:
+      a.movzx(a.eax, asmjit::X86Mem(a.zdx, offset, 1));
+      break;
+   case QuantizedDataType::Signed8:
+      a.movsx(a.eax, asmjit::X86Mem(a.zdx, offset, 1));
+      break;
+   case QuantizedDataType::Unsigned16:
+      a.mov(a.eax, 0);
+      a.mov(a.eax.r16(), asmjit::X86Mem(a.zdx, offset));
+      a.xchg(a.eax.r8Hi(), a.eax.r8Lo());
+      break;
+   case QuantizedDataType::Signed16:
+      a.mov(a.eax, 0);
+      a.mov(a.eax.r16(), asmjit::X86Mem(a.zdx, offset));
+      a.xchg(a.eax.r8Hi(), a.eax.r8Lo());
+      a.movsx(a.eax, a.eax.r16());
+      break;
+   default:
+      assert(0);
+   }
+
+   a.cvtsi2sd(reg, a.eax);
+
+   if (exp != 0) {
+      a.mov(a.zax, getQuantizedScale(-exp));
+      a.movq(a.xmm3, a.zax);
+      a.mulsd(reg, a.xmm3);
+   }
+}
+
 template<unsigned flags = 0>
 static bool
 psqLoad(PPCEmuAssembler& a, Instruction instr)
 {
-   return jit_fallback(a, instr);
+   auto i = (flags & PsqLoadIndexed) ? instr.qi : instr.i;
+   auto w = (flags & PsqLoadIndexed) ? instr.qw : instr.w;
+
+   if (!a.gqrKnown) {
+      return jit_fallback(a, instr);
+   }
+
+   gqr_t gqr;
+   gqr.value = a.gqrValues[i];
+
+   auto type = static_cast<QuantizedDataType>(gqr.ld_type);
+   auto exp = getQuantizedExponent(gqr.ld_scale);
+
+   if (!isKnownQuantizedType(type)) {
+      return jit_fallback(a, instr);
+   }
+
+   asmjit::Label fallback(a);
+   psqPrologue(a, instr, i, GqrLoadMask, !!(flags & PsqLoadZeroRA), !!(flags & PsqLoadIndexed), fallback);
+
+   psqLoadElement(a, type, exp, 0, a.xmm0, fallback);
+
+   if (w == 0) {
+      psqLoadElement(a, type, exp, getQuantizedSize(type), a.xmm1, fallback);
+   } else {
+      a.mov(a.zax, UINT64_C(0x3FF0000000000000));
+      a.movq(a.xmm1, a.zax);
+   }
+
+   a.movq(a.ppcfprps[instr.frD][0], a.xmm0);
+   a.movq(a.ppcfprps[instr.frD][1], a.xmm1);
+
+   if (flags & PsqLoadUpdate) {
+      a.storeGpr(instr.rA, a.ecx);
+   }
+
+   return jit_fallback_guarded(a, instr, fallback);
 }
 
 static bool
@@ -672,11 +859,129 @@ enum PsqStoreFlags
    PsqStoreIndexed = 1 << 2,
 };
 
+// Store fpr[n].pairedN quantized to [rdx + offset]
+static void
+psqStoreElement(PPCEmuAssembler& a, QuantizedDataType type, int exp, uint32_t fpr, int slot, int32_t offset)
+{
+   if (type == QuantizedDataType::Floating) {
+      asmjit::Label isZero(a), doStore(a);
+
+      // Values too small for a single are written as zero with the correct sign
+      a.mov(a.zax, a.ppcfprps[fpr][slot]);
+      a.mov(asmjit::x86::r8, a.zax);
+      a.shr(asmjit::x86::r8, 52);
+      a.and_(a.r8d, 0x7FF);
+      a.cmp(a.r8d, 896);
+      a.jbe(isZero);
+
+      a.movq(a.xmm0, a.zax);
+      a.cvtsd2ss(a.xmm0, a.xmm0);
+      a.movd(a.eax, a.xmm0);
+      a.jmp(doStore);
+
+      a.bind(isZero);
+      a.shr(a.zax, 32);
+      a.and_(a.eax, 0x80000000);
+
+      a.bind(doStore);
+      a.bswap(a.eax);
+      a.mov(asmjit::X86Mem(a.zdx, offset), a.eax);
+      return;
+   }
+
+   double min, max;
+
+   switch (type) {
+   case QuantizedDataType::Unsigned8:
+      min = std::numeric_limits<uint8_t>::min();
+      max = std::numeric_limits<uint8_t>::max();
+      break;
+   case QuantizedDataType::Signed8:
+      min = std::numeric_limits<int8_t>::min();
+      max = std::numeric_limits<int8_t>::max();
+      break;
+   case QuantizedDataType::Unsigned16:
+      min = std::numeric_limits<uint16_t>::min();
+      max = std::numeric_limits<uint16_t>::max();
+      break;
+   case QuantizedDataType::Signed16:
+      min = std::numeric_limits<int16_t>::min();
+      max = std::numeric_limits<int16_t>::max();
+      break;
+   default:
+      assert(0);
+   }
+
+   a.movq(a.xmm0, a.ppcfprps[fpr][slot]);
+
+   if (exp != 0) {
+      a.mov(a.zax, getQuantizedScale(exp));
+      a.movq(a.xmm1, a.zax);
+      a.mulsd(a.xmm0, a.xmm1);
+   }
+
+   // clamp<Type>(value)
+   a.mov(a.zax, bit_cast<uint64_t>(max));
+   a.movq(a.xmm1, a.zax);
+   a.minsd(a.xmm0, a.xmm1);
+   a.mov(a.zax, bit_cast<uint64_t>(min));
+   a.movq(a.xmm1, a.zax);
+   a.maxsd(a.xmm0, a.xmm1);
+   a.cvttsd2si(a.eax, a.xmm0);
+
+   if (getQuantizedSize(type) == 1) {
+      a.mov(asmjit::X86Mem(a.zdx, offset), a.eax.r8());
+   } else {
+      a.xchg(a.eax.r8Hi(), a.eax.r8Lo());
+      a.mov(asmjit::X86Mem(a.zdx, offset), a.eax.r16());
+   }
+}
+
 template<unsigned flags = 0>
 static bool
 psqStore(PPCEmuAssembler& a, Instruction instr)
 {
-   return jit_fallback(a, instr);
+   auto i = (flags & PsqStoreIndexed) ? instr.qi : instr.i;
+   auto w = (flags & PsqStoreIndexed) ? instr.qw : instr.w;
+
+   if (!a.gqrKnown) {
+      return jit_fallback(a, instr);
+   }
+
+   gqr_t gqr;
+   gqr.value = a.gqrValues[i];
+
+   auto type = static_cast<QuantizedDataType>(gqr.st_type);
+   auto exp = getQuantizedExponent(gqr.st_scale);
+
+   if (!isKnownQuantizedType(type)) {
+      return jit_fallback(a, instr);
+   }
+
+   asmjit::Label fallback(a);
+
+   // NaN and infinity are left to the interpreter, check before storing anything
+   for (auto slot = 0; slot < (w ? 1 : 2); ++slot) {
+      a.mov(a.zax, a.ppcfprps[instr.frS][slot]);
+      a.shr(a.zax, 52);
+      a.and_(a.eax, 0x7FF);
+      a.cmp(a.eax, 0x7FF);
+      a.je(fallback);
+   }
+
+   psqPrologue(a, instr, i, GqrStoreMask, !!(flags & PsqStoreZeroRA), !!(flags & PsqStoreIndexed), fallback);
+
+   psqStoreElement(a, type, exp, instr.frS, 0, 0);
+
+   if (w == 0) {
+      psqStoreElement(a, type, exp, instr.frS, 1, getQuantizedSize(type));
+   }
+
+   if (flags & PsqStoreUpdate) {
+      a.storeGpr(instr.rA, a.ecx);
+   }
+
+   return jit_fallback_guarded(a, instr, fallback);
 }
 
 static bool
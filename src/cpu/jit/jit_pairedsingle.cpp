@@ -1,5 +1,4 @@
 #include "jit_insreg.h"
-#include "jit_float.h"
 #include "utils/bitutils.h"
 
 namespace cpu
@@ -8,6 +7,442 @@ namespace cpu
 namespace jit
 {
 
+/*
+The paired single emitters below only handle the common case natively and
+guard on the operands at runtime, anything which would raise an exception
+or needs special NaN handling calls into the interpreter instead. This keeps
+the results bit exact with interpreter_pairedsingle.cpp.
+
+FPSCR, FPRF are not updated, the same as jit_float.cpp.
+*/
+
+enum GuardFlags
+{
+   GuardSpecial   = 1 << 0, // NaN or infinity
+   GuardZero      = 1 << 1, // +0 or -0
+   GuardNegative  = 1 << 2, // Sign bit set
+   GuardRounding  = 1 << 3, // Has bits roundForMultiply would round
+   GuardInexact   = 1 << 4, // Is not exactly representable as a single
+};
+
+// Jump to fallback if fpr[n].pairedN matches any of the guard flags
+static void
+guardSlot(PPCEmuAssembler& a, uint32_t fpr, int slot, unsigned flags, const asmjit::Label& fallback)
+{
+   a.mov(a.zax, a.ppcfprps[fpr][slot]);
+
+   if (flags & GuardNegative) {
+      a.test(a.zax, a.zax);
+      a.js(fallback);
+   }
+
+   if (flags & GuardRounding) {
+      a.test(a.eax, 0x0FFFFFFF);
+      a.jnz(fallback);
+   }
+
+   if (flags & GuardZero) {
+      a.mov(a.zcx, a.zax);
+      a.shl(a.zcx, 1);
+      a.jz(fallback);
+   }
+
+   if (flags & GuardSpecial) {
+      a.mov(a.zcx, a.zax);
+      a.shr(a.zcx, 52);
+      a.and_(a.ecx, 0x7FF);
+      a.cmp(a.ecx, 0x7FF);
+      a.je(fallback);
+   }
+
+   if (flags & GuardInexact) {
+      // Zero, or a normal single with no extra mantissa bits
+      asmjit::Label exact(a);
+      a.test(a.eax, 0x1FFFFFFF);
+      a.jnz(fallback);
+      a.mov(a.zcx, a.zax);
+      a.shl(a.zcx, 1);
+      a.jz(exact);
+      a.shr(a.zcx, 53);
+      a.sub(a.ecx, 897);
+      a.cmp(a.ecx, 1150 - 897);
+      a.ja(fallback);
+      a.bind(exact);
+   }
+}
+
+static void
+guardPair(PPCEmuAssembler& a, uint32_t fpr, unsigned flags, const asmjit::Label& fallback)
+{
+   guardSlot(a, fpr, 0, flags, fallback);
+   guardSlot(a, fpr, 1, flags, fallback);
+}
+
+// Load {fpr[n].pairedX, fpr[n].pairedY} into reg
+template<int slot0, int slot1>
+static void
+loadPaired(PPCEmuAssembler& a, const asmjit::X86XmmReg& reg, uint32_t fpr)
+{
+   static_assert((slot0 == 0 && slot1 == 1) || slot0 == slot1, "Unsupported paired slot order");
+
+   if (slot0 == 0 && slot1 == 1) {
+      a.movupd(reg, a.ppcfpr[fpr]);
+   } else {
+      a.movq(reg, a.ppcfprps[fpr][slot0]);
+      a.unpcklpd(reg, reg);
+   }
+}
+
+// Round both doubles in reg to single and store them in fpr[n]
+static void
+storePairedSingle(PPCEmuAssembler& a, uint32_t fpr, const asmjit::X86XmmReg& reg)
+{
+   a.cvtpd2ps(reg, reg);
+   a.cvtps2pd(reg, reg);
+   a.movupd(a.ppcfpr[fpr], reg);
+}
+
+// Broadcast a single constant to both float lanes of reg
+static void
+loadSingleConstant(PPCEmuAssembler& a, const asmjit::X86XmmReg& reg, uint32_t bits)
+{
+   a.mov(a.eax, bits);
+   a.movd(reg, a.eax);
+   a.pshufd(reg, reg, 0);
+}
+
+// Register move / sign bit manipulation
+enum MoveMode
+{
+   MoveDirect,
+   MoveNegate,
+   MoveAbsolute,
+   MoveNegAbsolute,
+};
+
+static void
+applyMoveMode(PPCEmuAssembler& a, MoveMode mode, const asmjit::X86GpReg& reg)
+{
+   switch (mode) {
+   case MoveDirect:
+      break;
+   case MoveNegate:
+      a.xor_(reg, 0x80000000);
+      break;
+   case MoveAbsolute:
+      a.and_(reg, 0x7FFFFFFF);
+      break;
+   case MoveNegAbsolute:
+      a.or_(reg, 0x80000000);
+      break;
+   }
+}
+
+template<MoveMode mode>
+static bool
+moveGeneric(PPCEmuAssembler& a, Instruction instr)
+{
+   if (instr.rc) {
+      return jit_fallback(a, instr);
+   }
+
+   asmjit::Label fallback(a);
+   guardPair(a, instr.frB, GuardSpecial, fallback);
+
+   // ps0 is rounded to single
+   a.movq(a.xmm0, a.ppcfprps[instr.frB][0]);
+   a.cvtsd2ss(a.xmm0, a.xmm0);
+   a.movd(a.eax, a.xmm0);
+
+   // ps1 is truncated to single, see truncate_double_bits
+   a.mov(a.zcx, a.ppcfprps[instr.frB][1]);
+   a.mov(a.zdx, a.zcx);
+   a.shr(a.zdx, 32);
+   a.and_(a.edx, 0xC0000000);
+   a.shr(a.zcx, 29);
+   a.and_(a.ecx, 0x3FFFFFFF);
+   a.or_(a.ecx, a.edx);
+
+   applyMoveMode(a, mode, a.eax);
+   applyMoveMode(a, mode, a.ecx);
+
+   a.movd(a.xmm0, a.eax);
+   a.cvtss2sd(a.xmm0, a.xmm0);
+   a.movd(a.xmm1, a.ecx);
+   a.cvtss2sd(a.xmm1, a.xmm1);
+   a.movq(a.ppcfprps[instr.frD][0], a.xmm0);
+   a.movq(a.ppcfprps[instr.frD][1], a.xmm1);
+
+   return jit_fallback_guarded(a, instr, fallback);
+}
+
+// Move Register
+static bool
+ps_mr(PPCEmuAssembler& a, Instruction instr)
+{
+   return moveGeneric<MoveDirect>(a, instr);
+}
+
+// Negate
+static bool
+ps_neg(PPCEmuAssembler& a, Instruction instr)
+{
+   return moveGeneric<MoveNegate>(a, instr);
+}
+
+// Absolute
+static bool
+ps_abs(PPCEmuAssembler& a, Instruction instr)
+{
+   return moveGeneric<MoveAbsolute>(a, instr);
+}
+
+// Negative Absolute
+static bool
+ps_nabs(PPCEmuAssembler& a, Instruction instr)
+{
+   return moveGeneric<MoveNegAbsolute>(a, instr);
+}
+
+// Paired-single arithmetic
+enum PSArithOperator {
+    PSAdd,
+    PSSub,
+    PSMul,
+    PSDiv,
+};
+
+template<PSArithOperator op, int slotB0, int slotB1>
+static bool
+psArithGeneric(PPCEmuAssembler& a, Instruction instr)
+{
+   if (instr.rc) {
+      return jit_fallback(a, instr);
+   }
+
+   auto frB = (op == PSMul) ? instr.frC : instr.frB;
+   auto flagsB = static_cast<unsigned>(GuardSpecial);
+
+   if (op == PSDiv) {
+      flagsB |= GuardZero;
+   }
+
+   asmjit::Label fallback(a);
+   guardPair(a, instr.frA, GuardSpecial, fallback);
+
+   if (op == PSMul && (slotB0 == 0 || slotB1 == 0)) {
+      guardSlot(a, frB, 0, flagsB | GuardRounding, fallback);
+   } else {
+      guardSlot(a, frB, slotB0, flagsB, fallback);
+   }
+
+   if (slotB1 != slotB0) {
+      guardSlot(a, frB, slotB1, flagsB, fallback);
+   }
+
+   a.movupd(a.xmm0, a.ppcfpr[instr.frA]);
+   loadPaired<slotB0, slotB1>(a, a.xmm1, frB);
+
+   switch (op) {
+   case PSAdd:
+      a.addpd(a.xmm0, a.xmm1);
+      break;
+   case PSSub:
+      a.subpd(a.xmm0, a.xmm1);
+      break;
+   case PSMul:
+      a.mulpd(a.xmm0, a.xmm1);
+      break;
+   case PSDiv:
+      a.divpd(a.xmm0, a.xmm1);
+      break;
+   }
+
+   storePairedSingle(a, instr.frD, a.xmm0);
+   return jit_fallback_guarded(a, instr, fallback);
+}
+
+// Add
+static bool
+ps_add(PPCEmuAssembler& a, Instruction instr)
+{
+   return psArithGeneric<PSAdd, 0, 1>(a, instr);
+}
+
+// Subtract
+static bool
+ps_sub(PPCEmuAssembler& a, Instruction instr)
+{
+   return psArithGeneric<PSSub, 0, 1>(a, instr);
+}
+
+// Multiply
+static bool
+ps_mul(PPCEmuAssembler& a, Instruction instr)
+{
+   return psArithGeneric<PSMul, 0, 1>(a, instr);
+}
+
+static bool
+ps_muls0(PPCEmuAssembler& a, Instruction instr)
+{
+   return psArithGeneric<PSMul, 0, 0>(a, instr);
+}
+
+static bool
+ps_muls1(PPCEmuAssembler& a, Instruction instr)
+{
+   return psArithGeneric<PSMul, 1, 1>(a, instr);
+}
+
+// Divide
+static bool
+ps_div(PPCEmuAssembler& a, Instruction instr)
+{
+   return psArithGeneric<PSDiv, 0, 1>(a, instr);
+}
+
+template<int slot>
+static bool
+psSumGeneric(PPCEmuAssembler& a, Instruction instr)
+{
+   if (instr.rc) {
+      return jit_fallback(a, instr);
+   }
+
+   asmjit::Label fallback(a);
+   guardSlot(a, instr.frA, 0, GuardSpecial, fallback);
+   guardSlot(a, instr.frB, 1, GuardSpecial, fallback);
+
+   if (slot == 1) {
+      guardSlot(a, instr.frC, 0, GuardSpecial, fallback);
+   }
+
+   a.movq(a.xmm0, a.ppcfprps[instr.frA][0]);
+   a.movq(a.xmm1, a.ppcfprps[instr.frB][1]);
+   a.addsd(a.xmm0, a.xmm1);
+   a.cvtsd2ss(a.xmm0, a.xmm0);
+   a.cvtss2sd(a.xmm0, a.xmm0);
+
+   if (slot == 0) {
+      a.mov(a.zax, a.ppcfprps[instr.frC][1]);
+      a.movq(a.ppcfprps[instr.frD][0], a.xmm0);
+      a.mov(a.ppcfprps[instr.frD][1], a.zax);
+   } else {
+      a.movq(a.xmm1, a.ppcfprps[instr.frC][0]);
+      a.cvtsd2ss(a.xmm1, a.xmm1);
+      a.cvtss2sd(a.xmm1, a.xmm1);
+      a.movq(a.ppcfprps[instr.frD][0], a.xmm1);
+      a.movq(a.ppcfprps[instr.frD][1], a.xmm0);
+   }
+
+   return jit_fallback_guarded(a, instr, fallback);
+}
+
+// Sum High
+static bool
+ps_sum0(PPCEmuAssembler& a, Instruction instr)
+{
+   return psSumGeneric<0>(a, instr);
+}
+
+// Sum Low
+static bool
+ps_sum1(PPCEmuAssembler& a, Instruction instr)
+{
+   return psSumGeneric<1>(a, instr);
+}
+
+// Fused multiply-add instructions
+enum FMAFlags
+{
+   FMASubtract   = 1 << 0, // Subtract instead of add
+   FMANegate     = 1 << 1, // Negate result
+};
+
+// Requires FMA3, only registered when the host supports it
+template<unsigned flags, int slotC0, int slotC1>
+static bool
+fmaGeneric(PPCEmuAssembler& a, Instruction instr)
+{
+   if (instr.rc) {
+      return jit_fallback(a, instr);
+   }
+
+   asmjit::Label fallback(a);
+   guardPair(a, instr.frA, GuardSpecial, fallback);
+   guardPair(a, instr.frB, GuardSpecial, fallback);
+
+   if (slotC0 == 0 || slotC1 == 0) {
+      guardSlot(a, instr.frC, 0, GuardSpecial | GuardRounding, fallback);
+   } else {
+      guardSlot(a, instr.frC, slotC0, GuardSpecial, fallback);
+   }
+
+   if (slotC1 != slotC0) {
+      guardSlot(a, instr.frC, slotC1, GuardSpecial, fallback);
+   }
+
+   a.movupd(a.xmm0, a.ppcfpr[instr.frA]);
+   loadPaired<slotC0, slotC1>(a, a.xmm1, instr.frC);
+   a.movupd(a.xmm2, a.ppcfpr[instr.frB]);
+
+   if (flags & FMASubtract) {
+      a.vfmsub231pd(a.xmm2, a.xmm0, a.xmm1);
+   } else {
+      a.vfmadd231pd(a.xmm2, a.xmm0, a.xmm1);
+   }
+
+   a.cvtpd2ps(a.xmm2, a.xmm2);
+
+   // The interpreter negates after rounding to single
+   if (flags & FMANegate) {
+      loadSingleConstant(a, a.xmm3, 0x80000000);
+      a.xorps(a.xmm2, a.xmm3);
+   }
+
+   a.cvtps2pd(a.xmm2, a.xmm2);
+   a.movupd(a.ppcfpr[instr.frD], a.xmm2);
+
+   return jit_fallback_guarded(a, instr, fallback);
+}
+
+static bool
+ps_madd(PPCEmuAssembler& a, Instruction instr)
+{
+   return fmaGeneric<0, 0, 1>(a, instr);
+}
+
+static bool
+ps_madds0(PPCEmuAssembler& a, Instruction instr)
+{
+   return fmaGeneric<0, 0, 0>(a, instr);
+}
+
+static bool
+ps_madds1(PPCEmuAssembler& a, Instruction instr)
+{
+   return fmaGeneric<0, 1, 1>(a, instr);
+}
+
+static bool
+ps_msub(PPCEmuAssembler& a, Instruction instr)
+{
+   return fmaGeneric<FMASubtract, 0, 1>(a, instr);
+}
+
+static bool
+ps_nmadd(PPCEmuAssembler& a, Instruction instr)
+{
+   return fmaGeneric<FMANegate, 0, 1>(a, instr);
+}
+
+static bool
+ps_nmsub(PPCEmuAssembler& a, Instruction instr)
+{
+   return fmaGeneric<FMANegate | FMASubtract, 0, 1>(a, instr);
+}
+
 // Merge registers
 enum MergeFlags
 {
@@ -19,26 +454,28 @@ template<unsigned flags = 0>
 static bool
 mergeGeneric(PPCEmuAssembler& a, Instruction instr)
 {
-   if (flags & MergeValue0) {
-      a.mov(a.zax, a.ppcfprps[instr.frA][1]);
-   } else {
-      a.mov(a.zax, a.ppcfprps[instr.frA][0]);
+   if (instr.rc) {
+      return jit_fallback(a, instr);
    }
 
-   if (flags & MergeValue1) {
-      a.mov(a.zcx, a.ppcfprps[instr.frB][1]);
-   } else {
-      a.mov(a.zcx, a.ppcfprps[instr.frB][0]);
-   }
+   auto slotA = (flags & MergeValue0) ? 1 : 0;
+   auto slotB = (flags & MergeValue1) ? 1 : 0;
 
-   a.mov(a.ppcfprps[instr.frD][0], a.zax);
-   a.mov(a.ppcfprps[instr.frD][1], a.zcx);
+   // Slot 1 is truncated rather than rounded, which only matches a plain
+   //   copy when the value is already exactly a single.
+   asmjit::Label fallback(a);
+   guardSlot(a, instr.frA, slotA, GuardSpecial, fallback);
+   guardSlot(a, instr.frB, slotB, GuardInexact, fallback);
 
-   if (instr.rc) {
-      updateFloatConditionRegister(a, a.zax, a.zcx);
-   }
+   a.movq(a.xmm0, a.ppcfprps[instr.frA][slotA]);
+   a.cvtsd2ss(a.xmm0, a.xmm0);
+   a.cvtss2sd(a.xmm0, a.xmm0);
+   a.mov(a.zax, a.ppcfprps[instr.frB][slotB]);
 
-   return true;
+   a.movq(a.ppcfprps[instr.frD][0], a.xmm0);
+   a.mov(a.ppcfprps[instr.frD][1], a.zax);
+
+   return jit_fallback_guarded(a, instr, fallback);
 }
 
 static bool
@@ -65,33 +502,114 @@ ps_merge10(PPCEmuAssembler& a, Instruction instr)
    return mergeGeneric<MergeValue0>(a, instr);
 }
 
+// Reciprocal
+static bool
+ps_res(PPCEmuAssembler& a, Instruction instr)
+{
+   if (instr.rc) {
+      return jit_fallback(a, instr);
+   }
+
+   asmjit::Label fallback(a);
+   guardPair(a, instr.frB, GuardSpecial | GuardZero, fallback);
+
+   // d = 1.0f / static_cast<float>(b)
+   a.movupd(a.xmm0, a.ppcfpr[instr.frB]);
+   a.cvtpd2ps(a.xmm0, a.xmm0);
+   loadSingleConstant(a, a.xmm1, 0x3F800000);
+   a.divps(a.xmm1, a.xmm0);
+   a.cvtps2pd(a.xmm1, a.xmm1);
+   a.movupd(a.ppcfpr[instr.frD], a.xmm1);
+
+   return jit_fallback_guarded(a, instr, fallback);
+}
+
+// Reciprocal Square Root
+static bool
+ps_rsqrte(PPCEmuAssembler& a, Instruction instr)
+{
+   if (instr.rc) {
+      return jit_fallback(a, instr);
+   }
+
+   asmjit::Label fallback(a);
+   guardPair(a, instr.frB, GuardSpecial | GuardZero | GuardNegative, fallback);
+
+   // d = 1.0f / std::sqrt(static_cast<float>(b))
+   a.movupd(a.xmm0, a.ppcfpr[instr.frB]);
+   a.cvtpd2ps(a.xmm0, a.xmm0);
+   a.sqrtps(a.xmm0, a.xmm0);
+   loadSingleConstant(a, a.xmm1, 0x3F800000);
+   a.divps(a.xmm1, a.xmm0);
+   a.cvtps2pd(a.xmm1, a.xmm1);
+   a.movupd(a.ppcfpr[instr.frD], a.xmm1);
+
+   return jit_fallback_guarded(a, instr, fallback);
+}
+
+// Select
+static bool
+ps_sel(PPCEmuAssembler& a, Instruction instr)
+{
+   if (instr.rc) {
+      return jit_fallback(a, instr);
+   }
+
+   // mask = (0.0 <= a), false for NaN just like (a >= 0)
+   a.xorpd(a.xmm0, a.xmm0);
+   a.movupd(a.xmm1, a.ppcfpr[instr.frA]);
+   a.cmppd(a.xmm0, a.xmm1, 2);
+
+   // d = (c & mask) | (b & ~mask)
+   a.movupd(a.xmm2, a.ppcfpr[instr.frC]);
+   a.movupd(a.xmm3, a.ppcfpr[instr.frB]);
+   a.andpd(a.xmm2, a.xmm0);
+   a.andnpd(a.xmm0, a.xmm3);
+   a.orpd(a.xmm0, a.xmm2);
+   a.movupd(a.ppcfpr[instr.frD], a.xmm0);
+
+   return true;
+}
+
 void registerPairedInstructions()
 {
-   RegisterInstructionFallback(ps_add);
-   RegisterInstructionFallback(ps_div);
-   RegisterInstructionFallback(ps_mul);
-   RegisterInstructionFallback(ps_sub);
-   RegisterInstructionFallback(ps_abs);
-   RegisterInstructionFallback(ps_nabs);
-   RegisterInstructionFallback(ps_neg);
-   RegisterInstructionFallback(ps_sel);
-   RegisterInstructionFallback(ps_res);
-   RegisterInstructionFallback(ps_rsqrte);
-   RegisterInstructionFallback(ps_msub);
-   RegisterInstructionFallback(ps_madd);
-   RegisterInstructionFallback(ps_nmsub);
-   RegisterInstructionFallback(ps_nmadd);
-   RegisterInstructionFallback(ps_mr);
-   RegisterInstructionFallback(ps_sum0);
-   RegisterInstructionFallback(ps_sum1);
-   RegisterInstructionFallback(ps_muls0);
-   RegisterInstructionFallback(ps_muls1);
-   RegisterInstructionFallback(ps_madds0);
-   RegisterInstructionFallback(ps_madds1);
+   auto hasFMA3 = asmjit::X86CpuInfo::getHost()->hasFeature(asmjit::kX86CpuFeatureFMA3);
+
+   RegisterInstruction(ps_add);
+   RegisterInstruction(ps_div);
+   RegisterInstruction(ps_mul);
+   RegisterInstruction(ps_sub);
+   RegisterInstruction(ps_abs);
+   RegisterInstruction(ps_nabs);
+   RegisterInstruction(ps_neg);
+   RegisterInstruction(ps_sel);
+   RegisterInstruction(ps_res);
+   RegisterInstruction(ps_rsqrte);
+   RegisterInstruction(ps_mr);
+   RegisterInstruction(ps_sum0);
+   RegisterInstruction(ps_sum1);
+   RegisterInstruction(ps_muls0);
+   RegisterInstruction(ps_muls1);
    RegisterInstruction(ps_merge00);
    RegisterInstruction(ps_merge01);
    RegisterInstruction(ps_merge10);
    RegisterInstruction(ps_merge11);
+
+   if (hasFMA3) {
+      RegisterInstruction(ps_msub);
+      RegisterInstruction(ps_madd);
+      RegisterInstruction(ps_nmsub);
+      RegisterInstruction(ps_nmadd);
+      RegisterInstruction(ps_madds0);
+      RegisterInstruction(ps_madds1);
+   } else {
+      RegisterInstructionFallback(ps_msub);
+      RegisterInstructionFallback(ps_madd);
+      RegisterInstructionFallback(ps_nmsub);
+      RegisterInstructionFallback(ps_nmadd);
+      RegisterInstructionFallback(ps_madds0);
+      RegisterInstructionFallback(ps_madds1);
+   }
 }
 
 } // namespace jit
@@ -1,5 +1,7 @@
 #include <cassert>
+#include <cstddef>
 #include "jit_insreg.h"
+#include "../cpu_internal.h"
 #include "utils/bitutils.h"
 #include "utils/log.h"
 
@@ -52,34 +54,34 @@ mfspr(PPCEmuAssembler& a, Instruction instr)
       a.mov(a.eax, a.ppcctr);
       break;
    case SprEncoding::UGQR0:
-      a.mov(a.eax, a.ppcgpr[0]);
+      a.mov(a.eax, a.ppcgqr[0]);
       break;
    case SprEncoding::UGQR1:
-      a.mov(a.eax, a.ppcgpr[1]);
+      a.mov(a.eax, a.ppcgqr[1]);
       break;
    case SprEncoding::UGQR2:
-      a.mov(a.eax, a.ppcgpr[2]);
+      a.mov(a.eax, a.ppcgqr[2]);
       break;
    case SprEncoding::UGQR3:
-      a.mov(a.eax, a.ppcgpr[3]);
+      a.mov(a.eax, a.ppcgqr[3]);
       break;
    case SprEncoding::UGQR4:
-      a.mov(a.eax, a.ppcgpr[4]);
+      a.mov(a.eax, a.ppcgqr[4]);
       break;
    case SprEncoding::UGQR5:
-      a.mov(a.eax, a.ppcgpr[5]);
+      a.mov(a.eax, a.ppcgqr[5]);
       break;
    case SprEncoding::UGQR6:
-      a.mov(a.eax, a.ppcgpr[6]);
+      a.mov(a.eax, a.ppcgqr[6]);
       break;
    case SprEncoding::UGQR7:
-      a.mov(a.eax, a.ppcgpr[7]);
+      a.mov(a.eax, a.ppcgqr[7]);
       break;
    default:
       gLog->error("Invalid mfspr SPR {}", static_cast<uint32_t>(spr));
    }
 
-   a.mov(a.ppcgpr[instr.rD], a.eax);
+   a.storeGpr(instr.rD, a.eax);
    return true;
 }
 
@@ -87,7 +89,7 @@ mfspr(PPCEmuAssembler& a, Instruction instr)
 static bool
 mtspr(PPCEmuAssembler& a, Instruction instr)
 {
-   a.mov(a.eax, a.ppcgpr[instr.rD]);
+   a.loadGpr(a.eax, instr.rD);
 
    auto spr = decodeSPR(instr);
    switch (spr) {
@@ -131,6 +133,53 @@ mtspr(PPCEmuAssembler& a, Instruction instr)
    return true;
 }
 
+static const int32_t
+TimeBaseOriginOffset = static_cast<int32_t>(offsetof(cpu::TimeBase, origin));
+
+static const int32_t
+TimeBaseScaleOffset = static_cast<int32_t>(offsetof(cpu::TimeBase, tickScale));
+
+// Move from Time Base Register
+//   Reads the invariant TSC inline as ticks = ((tsc - origin) * tickScale) >> 32,
+//   anything else goes through the interpreter's cpu::getTimeBase.
+static bool
+mftb(PPCEmuAssembler& a, Instruction instr)
+{
+   auto tbr = decodeSPR(instr);
+
+   if (a.virtualTime || !cpu::hasTscTimeBase()
+    || (tbr != SprEncoding::UTBL && tbr != SprEncoding::UTBU)) {
+      // The virtual clock has to include this block's instructions so far
+      jit_flush_time(a);
+      return jit_fallback(a, instr);
+   }
+
+   a.rdtsc();
+   a.shl(a.zdx, 32);
+   a.or_(a.zax, a.zdx);
+   a.movSymbol(a.zcx, JitSymbol::TimeBase);
+   a.sub(a.zax, asmjit::X86Mem(a.zcx, TimeBaseOriginOffset, 8));
+   a.mul(asmjit::X86Mem(a.zcx, TimeBaseScaleOffset, 8));
+   a.shrd(a.zax, a.zdx, 32);
+
+   if (tbr == SprEncoding::UTBU) {
+      a.shr(a.zax, 32);
+   }
+
+   a.storeGpr(instr.rD, a.eax);
+   return true;
+}
+
+// Kernel calls may reschedule the guest thread, so they go through a
+//   stub which keeps the calling block's code alive until it returns.
+void
+jit_kernel_call_stub(ThreadState *state, void *data, KernelCallFn fn, uint64_t region)
+{
+   beginCallout(state, region);
+   fn(state, data);
+   endCallout(state, region);
+}
+
 // Kernel call
 static bool
 kc(PPCEmuAssembler& a, Instruction instr)
@@ -144,9 +193,14 @@ kc(PPCEmuAssembler& a, Instruction instr)
       return false;
    }
 
+   a.flushGprCache();
    a.mov(a.zcx, a.state);
-   a.mov(a.zdx, asmjit::Ptr(kc->second));
-   a.call(asmjit::Ptr(kc->first));
+   a.movSymbol(a.zdx, JitSymbol::KernelCallData, id);
+   a.movSymbol(asmjit::x86::r8, JitSymbol::KernelCallFn, id);
+   a.movSymbol(asmjit::x86::r9, JitSymbol::CodeRegion);
+   a.movSymbol(a.zax, JitSymbol::KernelCallStub);
+   a.call(a.zax);
+   a.loadGprCache();
    return true;
 }
 
@@ -160,12 +214,13 @@ registerSystemInstructions()
    RegisterInstructionFallback(dcbtst);
    RegisterInstructionFallback(dcbz);
    RegisterInstructionFallback(dcbz_l);
+   RegisterInstructionFallback(icbi);
    RegisterInstruction(eieio);
    RegisterInstruction(isync);
    RegisterInstruction(sync);
    RegisterInstruction(mfspr);
    RegisterInstruction(mtspr);
-   RegisterInstructionFallback(mftb);
+   RegisterInstruction(mftb);
    RegisterInstructionFallback(mfmsr);
    RegisterInstructionFallback(mtmsr);
    RegisterInstructionFallback(mfsr);
@@ -422,10 +422,27 @@ namespace cpu
 struct CoreState
 {
    std::atomic_bool interrupt { false };
+
+   // Virtual time mode, the number of instructions this core has run and
+   //   the count at which it raises an interrupt, see cpu::setVirtualTime
+   std::atomic<uint64_t> virtualTime { 0 };
+   std::atomic<uint64_t> virtualDeadline { UINT64_MAX };
 };
 
 }
 
+// An entry in the JIT return address stack
+struct ReturnStackEntry
+{
+   uint64_t key;     // Guest return address | JIT epoch << 32
+   void *code;       // JIT code for the guest return address
+};
+
+static const uint32_t ReturnStackSize = 16;
+
+// Nested calls out of JIT code whose region pin is tracked per thread
+static const uint32_t JitMaxCalloutDepth = 32;
+
 // Thread registers
 // TODO: Some system registers may not be thread-specific!
 struct ThreadState
@@ -458,4 +475,19 @@ struct ThreadState
    bool reserve;
    uint32_t reserveAddress;
    uint32_t reserveData;
+
+   // Return address stack used by the JIT to predict bclr
+   uint32_t returnStackTop;
+   ReturnStackEntry returnStack[ReturnStackSize];
+
+   // JIT code arena epoch this thread entered generated code at, and
+   //   the code region (index + 1) it holds a pin on, see jit_arena.h
+   uint32_t jitEpoch;
+   uint32_t jitPinnedRegion;
+
+   // Regions pinned by calls out of generated code which have not yet
+   //   returned, released by jit::releaseThread if the thread exits
+   //   inside one.
+   uint32_t jitCalloutDepth;
+   uint32_t jitCalloutRegions[JitMaxCalloutDepth];
 };
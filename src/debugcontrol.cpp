@@ -115,17 +115,16 @@ DebugControl::maybeBreak(uint32_t addr, ThreadState *state, uint32_t coreId)
       return;
    }
 
-   auto &bps = gDebugger.getBreakpoints();
-   auto itr = bps->find(addr);
+   uint32_t userData;
 
-   if (itr != bps->end()) {
+   if (gDebugger.findBreakpoint(addr, userData)) {
       pauseAll();
 
       // Send a message to the debugger before we pause ourself
       auto msg = new DebugMessageBpHit();
       msg->coreId = coreId;
       msg->address = addr;
-      msg->userData = itr->second;
+      msg->userData = userData;
       gDebugger.notify(msg);
 
       pauseCore(state, coreId);
@@ -10,6 +10,7 @@
 #include "debugmsg.h"
 #include "debugnet.h"
 #include "debugcontrol.h"
+#include "cpu/cpu.h"
 #include "processor.h"
 #include "utils/log.h"
 
@@ -21,6 +22,9 @@ gDebugger;
 Debugger::Debugger()
    : mEnabled(false), mBreakpoints(new BreakpointListType())
 {
+   for (auto &word : mBreakpointPages) {
+      word.store(0, std::memory_order_relaxed);
+   }
 }
 
 void
@@ -167,6 +171,9 @@ Debugger::addBreakpoint(uint32_t addr, uint32_t userData)
 {
    assert(mEnabled);
 
+   // Serialised so a page bit always matches the newest list
+   std::lock_guard<std::mutex> lock { mBreakpointMutex };
+
    while (true) {
       BreakpointList oldList = mBreakpoints;
       BreakpointList newList(new BreakpointListType(*oldList));
@@ -178,8 +185,12 @@ Debugger::addBreakpoint(uint32_t addr, uint32_t userData)
       }
 
       // Successful swap!
+      updateBreakpointPage(addr, *newList);
       break;
    }
+
+   // Recompile any code containing addr so the JIT adds a trap for it
+   cpu::invalidateInstructionCache(addr, 4);
 }
 
 void
@@ -187,6 +198,8 @@ Debugger::removeBreakpoint(uint32_t addr)
 {
    assert(mEnabled);
 
+   std::lock_guard<std::mutex> lock { mBreakpointMutex };
+
    while (true) {
       BreakpointList oldList = mBreakpoints;
       BreakpointList newList(new BreakpointListType(*oldList));
@@ -200,8 +213,69 @@ Debugger::removeBreakpoint(uint32_t addr)
          continue;
       }
 
+      updateBreakpointPage(addr, *newList);
       break;
    }
+
+   cpu::invalidateInstructionCache(addr, 4);
+}
+
+void
+Debugger::updateBreakpointPage(uint32_t addr, const BreakpointListType &list)
+{
+   auto page = addr >> BreakpointPageShift;
+   auto start = page << BreakpointPageShift;
+   auto end = static_cast<uint64_t>(start) + (1 << BreakpointPageShift);
+   auto itr = list.lower_bound(start);
+   auto bit = uint64_t { 1 } << (page % 64);
+
+   if (itr != list.end() && itr->first < end) {
+      mBreakpointPages[page / 64].fetch_or(bit);
+   } else {
+      mBreakpointPages[page / 64].fetch_and(~bit);
+   }
+}
+
+bool
+Debugger::hasBreakpointInRange(uint32_t start, uint32_t end) const
+{
+   if (start >= end) {
+      return false;
+   }
+
+   auto first = start >> BreakpointPageShift;
+   auto last = (end - 1) >> BreakpointPageShift;
+   auto found = false;
+
+   for (auto page = first; page <= last && !found; ++page) {
+      found = hasBreakpointPage(page << BreakpointPageShift);
+   }
+
+   if (!found) {
+      return false;
+   }
+
+   auto bps = std::atomic_load(&mBreakpoints);
+   auto itr = bps->lower_bound(start);
+   return itr != bps->end() && itr->first < end;
+}
+
+bool
+Debugger::findBreakpoint(uint32_t addr, uint32_t &userData) const
+{
+   if (!hasBreakpointPage(addr)) {
+      return false;
+   }
+
+   auto bps = std::atomic_load(&mBreakpoints);
+   auto itr = bps->find(addr);
+
+   if (itr == bps->end()) {
+      return false;
+   }
+
+   userData = itr->second;
+   return true;
 }
 
 
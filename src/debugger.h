@@ -67,15 +67,34 @@ public:
       return mBreakpoints;
    }
 
+   // Cheap filter for the hot paths, false means there is definitely
+   //   no breakpoint on the page holding addr.
+   bool hasBreakpointPage(uint32_t addr) const
+   {
+      auto page = addr >> BreakpointPageShift;
+      return !!((mBreakpointPages[page / 64].load(std::memory_order_relaxed) >> (page % 64)) & 1);
+   }
+
+   bool hasBreakpointInRange(uint32_t start, uint32_t end) const;
+   bool findBreakpoint(uint32_t addr, uint32_t &userData) const;
+
    void notify(DebugMessage *msg);
 
 protected:
+   static const uint32_t BreakpointPageShift = 12;
+   static const size_t BreakpointPageWords = (1ull << (32 - BreakpointPageShift)) / 64;
+
    void handleMessage(DebugMessage *pak);
    void debugThread();
+   void updateBreakpointPage(uint32_t addr, const BreakpointListType &list);
 
    bool mEnabled;
    std::thread mDebuggerThread;
    BreakpointList mBreakpoints;
+   std::mutex mBreakpointMutex;
+
+   // One bit per 4KB page of guest memory with at least one breakpoint
+   std::atomic<uint64_t> mBreakpointPages[BreakpointPageWords];
 
    std::queue<DebugMessage*> mMsgQueue;
    std::mutex mMsgLock;
@@ -1,5 +1,7 @@
+#include <cstring>
 #include <random>
 #include <string>
+#include <vector>
 #include "fuzztests.h"
 #include "cpu/instructionid.h"
 #include "cpu/instructiondata.h"
@@ -478,6 +480,7 @@ executeInstrTest(uint32_t test_seed)
    jState.tracer = nullptr;
    jState.cia = 0;
    jState.nia = instructionBase;
+   jState.jitPinnedRegion = 0;
 
    {
       memcpy(mem::translate(dataBase), iMem, memSize);
@@ -508,6 +511,161 @@ executeInstrTest(uint32_t test_seed)
    return true;
 }
 
+// Check the flattened decode table against the decode tree. Secondary
+//   opcode fields all sit in the low 16 bits, so every primary opcode and
+//   secondary index is covered, with random bits in the rest.
+static bool
+executeDecodeTests(uint32_t seed)
+{
+   std::mt19937 rand(seed);
+   auto failures = 0u;
+
+   for (auto opcd = 0u; opcd < 64; ++opcd) {
+      for (auto low = 0u; low <= 0xFFFF; ++low) {
+         auto instr = Instruction { (opcd << 26) | (rand() & 0x03FF0000) | low };
+         auto fast = gInstructionTable.decode(instr);
+         auto slow = gInstructionTable.decodeTree(instr);
+
+         if (fast != slow) {
+            gLog->warn("Decode of {:08x} gave {} instead of {}", instr.value,
+                       fast ? fast->name : "nothing", slow ? slow->name : "nothing");
+            failures++;
+         }
+      }
+   }
+
+   return failures == 0;
+}
+
+enum class ReserveTest
+{
+   Success,          // lwarx, addi, stwcx. to the same word
+   InterveningStore, // lwarx, stw to the word, stwcx.
+   AddressMismatch,  // lwarx, stwcx. to the next word
+   NoReservation,    // stwcx. alone
+};
+
+// Run one reservation sequence on the interpreter or the JIT, returns the
+//   final value of the reserved word and the next one, and CR0[EQ].
+static void
+runReserveTest(ReserveTest test, bool jit, uint32_t initial, uint32_t &word0, uint32_t &word1, bool &stored)
+{
+   Instruction lwarx = gInstructionTable.encode(InstructionID::lwarx);
+   lwarx.rD = 3;
+   lwarx.rA = 0;
+   lwarx.rB = 4;
+
+   Instruction addi = gInstructionTable.encode(InstructionID::addi);
+   addi.rD = 3;
+   addi.rA = 3;
+   addi.simm = 1;
+
+   Instruction stw = gInstructionTable.encode(InstructionID::stw);
+   stw.rS = 5;
+   stw.rA = 4;
+   stw.d = 0;
+
+   Instruction stwcx = gInstructionTable.encode(InstructionID::stwcx);
+   stwcx.rS = 3;
+   stwcx.rA = 0;
+   stwcx.rB = test == ReserveTest::AddressMismatch ? 6 : 4;
+
+   Instruction bclr = gInstructionTable.encode(InstructionID::bclr);
+   bclr.bo = 0x1f;
+
+   std::vector<Instruction> code;
+
+   if (test != ReserveTest::NoReservation) {
+      code.push_back(lwarx);
+   }
+
+   code.push_back(test == ReserveTest::InterveningStore ? stw : addi);
+   code.push_back(stwcx);
+   code.push_back(bclr);
+
+   for (auto i = 0u; i < code.size(); ++i) {
+      mem::write(instructionBase + i * 4, code[i].value);
+   }
+
+   mem::write(dataBase, initial);
+   mem::write(dataBase + 4, initial);
+
+   cpu::CoreState core;
+   ThreadState state;
+   memset(&state, 0, sizeof(ThreadState));
+   state.core = &core;
+   state.cia = 0;
+   state.nia = instructionBase;
+   state.gpr[3] = initial;
+   state.gpr[4] = dataBase;
+   state.gpr[5] = ~initial;
+   state.gpr[6] = dataBase + 4;
+
+   if (jit) {
+      cpu::jit::clearCache();
+      cpu::jit::executeSub(&state);
+   } else {
+      cpu::interpreter::executeSub(&state);
+   }
+
+   word0 = mem::read<uint32_t>(dataBase);
+   word1 = mem::read<uint32_t>(dataBase + 4);
+   stored = !!(state.cr.cr0 & ConditionRegisterFlag::Equal);
+}
+
+// Check lwarx / stwcx. on the interpreter and JIT against the expected
+//   result of each sequence, stwcx. must only store when the reserved word
+//   is unchanged and the address matches the reservation.
+static bool
+executeReserveTests(uint32_t seed)
+{
+   static const ReserveTest tests[] = {
+      ReserveTest::Success,
+      ReserveTest::InterveningStore,
+      ReserveTest::AddressMismatch,
+      ReserveTest::NoReservation,
+   };
+
+   static const char *names[] = {
+      "success",
+      "intervening store",
+      "address mismatch",
+      "no reservation",
+   };
+
+   std::mt19937 rand(seed);
+   auto failures = 0u;
+
+   for (auto i = 0u; i < array_size(tests); ++i) {
+      auto test = tests[i];
+      auto initial = static_cast<uint32_t>(rand());
+      auto expectStored = (test == ReserveTest::Success);
+      auto expectWord0 = initial;
+      auto expectWord1 = initial;
+
+      if (test == ReserveTest::Success) {
+         expectWord0 = initial + 1;
+      } else if (test == ReserveTest::InterveningStore) {
+         expectWord0 = ~initial;
+      }
+
+      for (auto jit : { false, true }) {
+         uint32_t word0, word1;
+         bool stored;
+         runReserveTest(test, jit, initial, word0, word1, stored);
+
+         if (word0 != expectWord0 || word1 != expectWord1 || stored != expectStored) {
+            gLog->warn("lwarx/stwcx. {} failed on {}: words {:08x} {:08x} stored {}, expected {:08x} {:08x} stored {}",
+                       names[i], jit ? "JIT" : "interpreter",
+                       word0, word1, stored, expectWord0, expectWord1, expectStored);
+            failures++;
+         }
+      }
+   }
+
+   return failures == 0;
+}
+
 bool
 executeFuzzTests(uint32_t suite_seed)
 {
@@ -515,6 +673,14 @@ executeFuzzTests(uint32_t suite_seed)
       return false;
    }
 
+   if (!executeDecodeTests(suite_seed)) {
+      return false;
+   }
+
+   if (!executeReserveTests(suite_seed)) {
+      return false;
+   }
+
    std::mt19937 suite_rand(suite_seed);
 
    for (auto i = 0; i < 10000; ++i) {
@@ -173,6 +173,7 @@ bool runTests(const std::string &path)
 
          // Execute test
          mem::write(baseAddress, test.instr.value);
+         cpu::invalidateInstructionCache(baseAddress, 4);
          cpu::jit::clearCache();
          std::feclearexcept(FE_ALL_EXCEPT);
          cpu::executeSub(nullptr, &state);
@@ -7,6 +7,7 @@
 #include <vector>
 #include <zlib.h>
 #include "cpu/instructiondata.h"
+#include "cpu/jit/jit.h"
 #include "elf.h"
 #include "filesystem/filesystem.h"
 #include "kernelmodule.h"
@@ -821,6 +822,11 @@ Loader::loadRPL(const std::string &moduleName, const std::string &name, const gs
             auto start = section.virtAddress;
             auto end = section.virtAddress + section.virtSize;
             loadedMod->sections.emplace_back(LoadedSection { sectionName, start, end });
+
+            if (section.header.flags & elf::SHF_EXECINSTR) {
+               cpu::invalidateInstructionCache(start, end - start);
+               cpu::jit::registerCodeRegion(name, start, end);
+            }
          }
       }
    }
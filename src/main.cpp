@@ -60,9 +60,9 @@ static const char USAGE[] =
 R"(Decaf Emulator
 
 Usage:
-   decaf play [--jit | --jit-debug] [--log-file] [--log-async] [--no-log-stdout] [--log-level=<log-level>] [--sys-path=<sys-path>] <game directory>
+   decaf play [--jit | --jit-debug | --jit-tiered | --threaded] [--log-file] [--log-async] [--no-log-stdout] [--log-level=<log-level>] [--sys-path=<sys-path>] [--virtual-time] <game directory>
    decaf fuzz
-   decaf hwtest [--log-file] [--jit]
+   decaf hwtest [--log-file] [--jit | --threaded]
    decaf (-h | --help)
    decaf --version
 
@@ -71,6 +71,8 @@ Options:
    --version     Show version.
    --jit         Enables the JIT engine.
    --jit-debug   Verify JIT implementation against interpreter.
+   --jit-tiered  Interpret code until it is hot, then JIT it.
+   --threaded    Use the threaded interpreter.
    --no-log-stdout
                  Disable logging to stdout
    --log-file    Redirect log output to file.
@@ -80,6 +82,9 @@ Options:
                  Available levels: trace, debug, info, notice, warning, error, critical, alert, emerg, off
    --sys-path=<sys-path> 
                  Where to locate any external system files.
+   --virtual-time
+                 Drive guest time by instructions run instead of the host
+                 clock, so that runs are reproducible.
 )";
 
 static const std::string
@@ -102,8 +107,13 @@ int main(int argc, char **argv)
    // Allow command line options to override config
    if (arg_bool("--jit-debug")) {
       config::jit::debug = true;
+   } else if (arg_bool("--jit-tiered")) {
+      config::jit::enabled = true;
+      config::jit::tiered = true;
    } else if (arg_bool("--jit")) {
       config::jit::enabled = true;
+   } else if (arg_bool("--threaded")) {
+      config::interpreter::threaded = true;
    }
 
    if (arg_bool("--no-log-stdout")) {
@@ -126,6 +136,10 @@ int main(int argc, char **argv)
       config::system::system_path = arg_str("--sys-path");
    }
 
+   if (arg_bool("--virtual-time")) {
+      config::system::virtual_time = true;
+   }
+
    // Set log filename
    std::string logFilename;
 
@@ -193,16 +207,33 @@ initialiseEmulator(const std::string &logFilename)
    if (config::jit::enabled) {
       if (config::jit::debug) {
          cpu::setJitMode(cpu::JitMode::Debug);
+      } else if (config::jit::tiered) {
+         cpu::setJitMode(cpu::JitMode::Tiered);
       } else {
          cpu::setJitMode(cpu::JitMode::Enabled);
       }
+   } else if (config::interpreter::threaded) {
+      cpu::setJitMode(cpu::JitMode::Threaded);
    } else {
       cpu::setJitMode(cpu::JitMode::Disabled);
    }
 
    // Setup core
    mem::initialise();
+   cpu::jit::setCodeCacheSize(static_cast<size_t>(config::jit::code_cache_size) * 1024 * 1024);
+   cpu::setVirtualTime(config::system::virtual_time);
    cpu::initialise();
+   cpu::jit::setTierThreshold(config::jit::tier_threshold);
+
+   if (config::jit::enabled && !config::jit::debug) {
+      cpu::jit::setCachePath(config::jit::cache_path);
+
+      // Whether a block is interpreted whilst it compiles depends on host
+      //   timing, which would make virtual time differ between runs.
+      if (!config::system::virtual_time) {
+         cpu::jit::startCompileThreads(config::jit::compile_threads);
+      }
+   }
 
    // Kernel modules
    GameLoader::RegisterFunctions();
@@ -425,6 +456,12 @@ play(const fs::HostPath &path)
 
    // Stop all processor threads
    gProcessor.stop();
+   cpu::jit::stopCompileThreads();
+   cpu::jit::saveCache();
+
+   if (cpu::getJitMode() == cpu::JitMode::Tiered) {
+      tierStatsPrint();
+   }
 
    // TODO: OSFreeToSystem data
    return true;
@@ -34,6 +34,9 @@ gMemoryBase = 0;
 static platform::MemoryMappedFile *
 gMapHandle = nullptr;
 
+static WriteFaultHandler
+gWriteFaultHandler = nullptr;
+
 static void
 unmapMemory();
 
@@ -61,6 +64,12 @@ handleAccessViolation(platform::Exception *exception)
       }
    }
 
+   if (address && gWriteFaultHandler) {
+      if (gWriteFaultHandler(gsl::narrow_cast<ppcaddr_t>(address))) {
+         return platform::HandledException;
+      }
+   }
+
    return gProcessor.handleAccessViolation(gsl::narrow_cast<ppcaddr_t>(address));
 }
 
@@ -160,6 +169,45 @@ protect(ppcaddr_t address, size_t size)
    return platform::protectMemory(gMemoryBase + address, size);
 }
 
+void
+setWriteFaultHandler(WriteFaultHandler handler)
+{
+   gWriteFaultHandler = handler;
+}
+
+// Make memory read only, writes will go to the write fault handler
+bool
+writeProtect(ppcaddr_t address, size_t size)
+{
+   return platform::writeProtectMemory(gMemoryBase + address, size);
+}
+
+bool
+writeUnprotect(ppcaddr_t address, size_t size)
+{
+   return platform::unprotectMemory(gMemoryBase + address, size);
+}
+
+// Hand every page of the range to the write fault handler, as if the
+//   host write had faulted on it, so it is made writable and any code
+//   compiled from it is invalidated.
+void
+prepareHostWrite(ppcaddr_t address, size_t size)
+{
+   static const size_t PageSize = 0x1000;
+
+   if (!gWriteFaultHandler || !address || !size) {
+      return;
+   }
+
+   auto start = static_cast<size_t>(address) & ~(PageSize - 1);
+   auto end = static_cast<size_t>(address) + size;
+
+   for (auto page = start; page < end; page += PageSize) {
+      gWriteFaultHandler(gsl::narrow_cast<ppcaddr_t>(page));
+   }
+}
+
 // Cleanup memory, unmapping all views
 void
 shutdown()
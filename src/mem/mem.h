@@ -49,6 +49,24 @@ valid(ppcaddr_t address);
 bool
 protect(ppcaddr_t address, size_t size);
 
+// Called when a write hits a write protected page, return
+//   true if the fault was handled and the write should retry.
+using WriteFaultHandler = bool (*)(ppcaddr_t address);
+
+void
+setWriteFaultHandler(WriteFaultHandler handler);
+
+bool
+writeProtect(ppcaddr_t address, size_t size);
+
+bool
+writeUnprotect(ppcaddr_t address, size_t size);
+
+// System calls writing into guest memory fail on write protected pages
+//   instead of faulting, so host I/O must call this on its buffer first.
+void
+prepareHostWrite(ppcaddr_t address, size_t size);
+
 // Translate WiiU virtual address to host address
 template<typename Type = uint8_t>
 inline Type *
@@ -1,3 +1,5 @@
+#include <unordered_map>
+#include <vector>
 #include "coreinit.h"
 #include "coreinit_alarm.h"
 #include "coreinit_core.h"
@@ -26,6 +28,129 @@ const uint32_t
 OSAlarmQueue::Tag;
 
 
+/**
+ * Host side index of the alarms in a core's alarm queue, a binary min-heap
+ * ordered by nextFire with the position of each alarm so any of them can be
+ * removed. Lets checkAlarms visit only the alarms which have expired.
+ *
+ * An alarm's nextFire must not change whilst it is in the heap.
+ */
+class AlarmHeap
+{
+public:
+   OSAlarm *
+   top() const
+   {
+      return mHeap.empty() ? nullptr : mHeap.front();
+   }
+
+   void
+   insert(OSAlarm *alarm)
+   {
+      mIndex[alarm] = mHeap.size();
+      mHeap.push_back(alarm);
+      siftUp(mHeap.size() - 1);
+   }
+
+   void
+   erase(OSAlarm *alarm)
+   {
+      auto itr = mIndex.find(alarm);
+
+      if (itr == mIndex.end()) {
+         return;
+      }
+
+      auto pos = itr->second;
+      mIndex.erase(itr);
+
+      if (pos != mHeap.size() - 1) {
+         mHeap[pos] = mHeap.back();
+         mIndex[mHeap[pos]] = pos;
+         mHeap.pop_back();
+         siftDown(siftUp(pos));
+      } else {
+         mHeap.pop_back();
+      }
+   }
+
+private:
+   bool
+   less(size_t a, size_t b) const
+   {
+      return mHeap[a]->nextFire < mHeap[b]->nextFire;
+   }
+
+   void
+   swap(size_t a, size_t b)
+   {
+      std::swap(mHeap[a], mHeap[b]);
+      mIndex[mHeap[a]] = a;
+      mIndex[mHeap[b]] = b;
+   }
+
+   size_t
+   siftUp(size_t pos)
+   {
+      while (pos > 0) {
+         auto parent = (pos - 1) / 2;
+
+         if (!less(pos, parent)) {
+            break;
+         }
+
+         swap(pos, parent);
+         pos = parent;
+      }
+
+      return pos;
+   }
+
+   void
+   siftDown(size_t pos)
+   {
+      while (true) {
+         auto child = pos * 2 + 1;
+
+         if (child >= mHeap.size()) {
+            break;
+         }
+
+         if (child + 1 < mHeap.size() && less(child + 1, child)) {
+            child++;
+         }
+
+         if (!less(child, pos)) {
+            break;
+         }
+
+         swap(pos, child);
+         pos = child;
+      }
+   }
+
+private:
+   std::vector<OSAlarm *> mHeap;
+   std::unordered_map<OSAlarm *, size_t> mIndex;
+};
+
+static AlarmHeap
+gAlarmHeap[CoreCount];
+
+
+static AlarmHeap *
+getAlarmHeap(OSAlarmQueue *queue)
+{
+   for (auto i = 0u; i < CoreCount; ++i) {
+      if (gAlarmQueue[i] == queue) {
+         return &gAlarmHeap[i];
+      }
+   }
+
+   return nullptr;
+}
+
+
 /**
  * Internal alarm cancel.
  *
@@ -40,15 +165,19 @@ cancelAlarmNoLock(OSAlarm *alarm)
       return FALSE;
    }
 
-   alarm->state = OSAlarmState::Cancelled;
-   alarm->nextFire = 0;
-   alarm->period = 0;
-
    if (alarm->alarmQueue) {
+      if (auto heap = getAlarmHeap(alarm->alarmQueue)) {
+         heap->erase(alarm);
+      }
+
       OSEraseFromQueue<OSAlarmQueue>(alarm->alarmQueue, alarm);
       alarm->alarmQueue = nullptr;
    }
 
+   alarm->state = OSAlarmState::Cancelled;
+   alarm->nextFire = 0;
+   alarm->period = 0;
+
    OSWakeupThread(&alarm->threadQueue);
    return TRUE;
 }
@@ -162,6 +291,16 @@ OSSetPeriodicAlarm(OSAlarm *alarm, OSTime start, OSTime interval, AlarmCallback
 {
    ScopedSpinLock lock(gAlarmLock);
 
+   // Erase from old alarm queue
+   if (alarm->alarmQueue) {
+      if (auto heap = getAlarmHeap(alarm->alarmQueue)) {
+         heap->erase(alarm);
+      }
+
+      OSEraseFromQueue(static_cast<OSAlarmQueue*>(alarm->alarmQueue), alarm);
+      alarm->alarmQueue = nullptr;
+   }
+
    // Set alarm
    alarm->nextFire = start;
    alarm->callback = callback;
@@ -169,17 +308,12 @@ OSSetPeriodicAlarm(OSAlarm *alarm, OSTime start, OSTime interval, AlarmCallback
    alarm->context = nullptr;
    alarm->state = OSAlarmState::Set;
 
-   // Erase from old alarm queue
-   if (alarm->alarmQueue) {
-      OSEraseFromQueue(static_cast<OSAlarmQueue*>(alarm->alarmQueue), alarm);
-      alarm->alarmQueue = nullptr;
-   }
-
    // Add to this core's alarm queue
    auto core = OSGetCoreId();
    auto queue = gAlarmQueue[core];
    alarm->alarmQueue = queue;
    OSAppendQueue(queue, alarm);
+   gAlarmHeap[core].insert(alarm);
 
    // Set the interrupt timer in processor
    gProcessor.setInterruptTimer(core, coreinit::internal::toTimepoint(alarm->nextFire));
@@ -283,13 +417,15 @@ namespace internal
  * Wakes up any threads waiting on the alarm.
  */
 static void
-triggerAlarmNoLock(OSAlarmQueue *queue, OSAlarm *alarm, OSContext *context)
+triggerAlarmNoLock(OSAlarmQueue *queue, AlarmHeap &heap, OSAlarm *alarm, OSContext *context)
 {
    alarm->context = context;
+   heap.erase(alarm);
 
    if (alarm->period) {
       alarm->nextFire = OSGetTime() + alarm->period;
       alarm->state = OSAlarmState::Set;
+      heap.insert(alarm);
    } else {
       alarm->nextFire = 0;
       alarm->state = OSAlarmState::None;
@@ -316,36 +452,40 @@ void
 checkAlarms(uint32_t core, OSContext *context)
 {
    auto queue = gAlarmQueue[core];
+   auto &heap = gAlarmHeap[core];
    auto now = OSGetTime();
    auto next = std::chrono::time_point<std::chrono::system_clock>::max();
+   std::vector<OSAlarm *> expired;
 
    coreinit::internal::lockScheduler();
    OSUninterruptibleSpinLock_Acquire(gAlarmLock);
 
-   // Trigger all pending alarms
-   for (OSAlarm *alarm = queue->head; alarm; ) {
-      auto nextAlarm = alarm->link.next;
-
-      if (alarm->nextFire <= now && alarm->state != OSAlarmState::Cancelled) {
-         triggerAlarmNoLock(queue, alarm, context);
+   // Collect the expired alarms before running any callbacks, as they
+   //   may set alarms again which must not fire until the next check.
+   while (auto alarm = heap.top()) {
+      if (alarm->nextFire > now) {
+         break;
       }
 
-      alarm = nextAlarm;
+      expired.push_back(alarm);
+      heap.erase(alarm);
    }
 
-   // Find next set alarm
-   for (OSAlarm *alarm = queue->head; alarm; ) {
-      auto nextAlarm = alarm->link.next;
-
-      if (alarm->state == OSAlarmState::Set && alarm->nextFire) {
-         auto nextFire = coreinit::internal::toTimepoint(alarm->nextFire);
-
-         if (nextFire < next) {
-            next = nextFire;
-         }
+   // Trigger all pending alarms
+   for (auto alarm : expired) {
+      // An earlier callback may have cancelled or moved this alarm
+      if (alarm->state != OSAlarmState::Set
+       || alarm->alarmQueue != queue
+       || alarm->nextFire > now) {
+         continue;
       }
 
-      alarm = nextAlarm;
+      triggerAlarmNoLock(queue, heap, alarm, context);
+   }
+
+   // Find next set alarm
+   if (auto alarm = heap.top()) {
+      next = coreinit::internal::toTimepoint(alarm->nextFire);
    }
 
    OSUninterruptibleSpinLock_Release(gAlarmLock);
@@ -1,5 +1,6 @@
 #include "coreinit.h"
 #include "coreinit_cache.h"
+#include "cpu/cpu.h"
 #include "utils/align.h"
 
 namespace coreinit
@@ -53,7 +54,7 @@ DCTouchRange(void *addr, uint32_t size)
 void
 OSCoherencyBarrier()
 {
-   // TODO: OSCoherencyBarrier
+   cpu::invalidateModifiedCode();
 }
 
 void
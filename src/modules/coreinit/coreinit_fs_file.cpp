@@ -3,6 +3,7 @@
 #include "coreinit_fs_path.h"
 #include "coreinit_fs_file.h"
 #include "filesystem/filesystem.h"
+#include "mem/mem.h"
 #include "system.h"
 
 namespace coreinit
@@ -103,6 +104,7 @@ FSReadFile(FSClient *client,
       return FSStatus::FatalError;
    }
 
+   mem::prepareHostWrite(memory_untranslate(buffer), size * count);
    auto read = file->read(buffer, size, count);
    return static_cast<FSStatus>(read);
 }
@@ -125,6 +127,7 @@ FSReadFileWithPos(FSClient *client,
       return FSStatus::FatalError;
    }
 
+   mem::prepareHostWrite(memory_untranslate(buffer), size * count);
    auto read = file->read(buffer, size, count, position);
    return static_cast<FSStatus>(read);
 }
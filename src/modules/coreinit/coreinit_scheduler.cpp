@@ -6,6 +6,7 @@
 #include "coreinit_queue.h"
 #include "processor.h"
 #include "cpu/trace.h"
+#include "utils/log.h"
 
 namespace coreinit
 {
@@ -20,11 +21,16 @@ ThreadEntryPoint
 InterruptThreadEntryPoint;
 
 // Setup a thread fiber, used by OSRunThread and OSResumeThread
-static void
+static bool
 InitialiseThreadFiber(OSThread *thread)
 {
    // Create a fiber for the thread
    auto fiber = gProcessor.createFiber();
+
+   if (!fiber) {
+      return false;
+   }
+
    thread->fiber = fiber;
    fiber->thread = thread;
 
@@ -41,6 +47,7 @@ InitialiseThreadFiber(OSThread *thread)
 
    // Initialise tracer
    traceInit(&fiber->state, 1024);
+   return true;
 }
 
 namespace internal
@@ -82,8 +89,10 @@ resumeThreadNoLock(OSThread *thread, int32_t counter)
    if (thread->suspendCounter == 0) {
       if (thread->state == OSThreadState::Ready) {
          // Create a fiber for the thread to run on, if this is the first time!
-         if (!thread->fiber) {
-            InitialiseThreadFiber(thread);
+         if (!thread->fiber && !InitialiseThreadFiber(thread)) {
+            gLog->error("Could not start thread {}, no fiber available", thread->id);
+            thread->state = OSThreadState::None;
+            return old;
          }
 
          gProcessor.queue(thread->fiber);
@@ -2,6 +2,7 @@
 #include "coreinit_time.h"
 #include "coreinit_systeminfo.h"
 #include "platform/platform_time.h"
+#include "processor.h"
 
 namespace coreinit
 {
@@ -16,7 +17,7 @@ gEpochTime;
 OSTime
 OSGetTime()
 {
-   auto now = std::chrono::system_clock::now();
+   auto now = gProcessor.getGuestTime();
    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now - gEpochTime);
    return ns.count();
 }
@@ -107,13 +108,25 @@ Module::initialiseClock()
    gEpochTime = std::chrono::system_clock::from_time_t(platform::make_gm_time(tm));
 }
 
+/**
+ * Guest entry to the clock functions, a guest calling these back to back
+ * is busy waiting so let the processor release the core.
+ */
+template<typename Type, Type(*Fn)()>
+static Type
+pollTime()
+{
+   gProcessor.pollTime();
+   return Fn();
+}
+
 void
 Module::registerTimeFunctions()
 {
-   RegisterKernelFunction(OSGetTime);
-   RegisterKernelFunction(OSGetTick);
-   RegisterKernelFunction(OSGetSystemTime);
-   RegisterKernelFunction(OSGetSystemTick);
+   RegisterKernelFunctionName("OSGetTime", (pollTime<OSTime, OSGetTime>));
+   RegisterKernelFunctionName("OSGetTick", (pollTime<OSTick, OSGetTick>));
+   RegisterKernelFunctionName("OSGetSystemTime", (pollTime<OSTime, OSGetSystemTime>));
+   RegisterKernelFunctionName("OSGetSystemTick", (pollTime<OSTick, OSGetSystemTick>));
    RegisterKernelFunction(OSTicksToCalendarTime);
    RegisterKernelFunction(OSCalendarTimeToTicks);
 }
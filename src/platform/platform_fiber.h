@@ -14,6 +14,11 @@ getThreadFiber();
 Fiber *
 createFiber(FiberEntryPoint entry, void *entryParam);
 
+// Restart fiber from its entry point, must not be the running fiber.
+//   Returns false if the fiber could not be restarted and must be destroyed.
+bool
+resetFiber(Fiber *fiber);
+
 void
 destroyFiber(Fiber *fiber);
 
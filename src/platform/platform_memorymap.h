@@ -24,4 +24,16 @@ commitMemory(MemoryMappedFile *file, size_t address, size_t size);
 bool
 protectMemory(size_t address, size_t size);
 
+bool
+writeProtectMemory(size_t address, size_t size);
+
+bool
+unprotectMemory(size_t address, size_t size);
+
+void *
+allocateExecutableMemory(size_t size);
+
+bool
+freeExecutableMemory(void *address, size_t size);
+
 }
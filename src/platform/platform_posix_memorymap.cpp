@@ -65,6 +65,38 @@ protectMemory(size_t address, size_t size)
    return mprotect(baseAddress, size, PROT_NONE) == 0;
 }
 
+bool
+writeProtectMemory(size_t address, size_t size)
+{
+   auto baseAddress = reinterpret_cast<void *>(address);
+   return mprotect(baseAddress, size, PROT_READ) == 0;
+}
+
+bool
+unprotectMemory(size_t address, size_t size)
+{
+   auto baseAddress = reinterpret_cast<void *>(address);
+   return mprotect(baseAddress, size, PROT_READ | PROT_WRITE) == 0;
+}
+
+void *
+allocateExecutableMemory(size_t size)
+{
+   auto result = mmap(nullptr, size, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+   if (result == MAP_FAILED) {
+      return nullptr;
+   }
+
+   return result;
+}
+
+bool
+freeExecutableMemory(void *address, size_t size)
+{
+   return !munmap(address, size);
+}
+
 } // namespace platform
 
 #endif
@@ -36,13 +36,32 @@ createFiber(FiberEntryPoint entry, void *entryParam)
    fiber->handle = CreateFiber(0, &fiberEntryPoint, fiber);
    fiber->entry = entry;
    fiber->entryParam = entryParam;
+
+   if (!fiber->handle) {
+      delete fiber;
+      return nullptr;
+   }
+
    return fiber;
 }
 
+// Windows fibers cannot be restarted from their entry point, so the
+//   fiber is deleted and a new one created in its place.
+bool
+resetFiber(Fiber *fiber)
+{
+   DeleteFiber(fiber->handle);
+   fiber->handle = CreateFiber(0, &fiberEntryPoint, fiber);
+   return fiber->handle != nullptr;
+}
+
 void
 destroyFiber(Fiber *fiber)
 {
-   DeleteFiber(fiber->handle);
+   if (fiber->handle) {
+      DeleteFiber(fiber->handle);
+   }
+
    delete fiber;
 }
 
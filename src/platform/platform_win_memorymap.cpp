@@ -86,6 +86,34 @@ protectMemory(size_t address, size_t size)
    return (result != baseAddress);
 }
 
+bool
+writeProtectMemory(size_t address, size_t size)
+{
+   auto baseAddress = reinterpret_cast<LPVOID>(address);
+   DWORD oldProtect;
+   return !!VirtualProtect(baseAddress, size, PAGE_READONLY, &oldProtect);
+}
+
+bool
+unprotectMemory(size_t address, size_t size)
+{
+   auto baseAddress = reinterpret_cast<LPVOID>(address);
+   DWORD oldProtect;
+   return !!VirtualProtect(baseAddress, size, PAGE_READWRITE, &oldProtect);
+}
+
+void *
+allocateExecutableMemory(size_t size)
+{
+   return VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_EXECUTE_READWRITE);
+}
+
+bool
+freeExecutableMemory(void *address, size_t size)
+{
+   return !!VirtualFree(address, 0, MEM_RELEASE);
+}
+
 } // namespace platform
 
 #endif
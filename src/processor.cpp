@@ -1,6 +1,7 @@
 #include <algorithm>
 #include <cfenv>
 #include "cpu/cpu.h"
+#include "cpu/jit/jit.h"
 #include "cpu/state.h"
 #include "debugcontrol.h"
 #include "modules/coreinit/coreinit_core.h"
@@ -10,6 +11,7 @@
 #include "platform/platform_thread.h"
 #include "processor.h"
 #include "ppcinvoke.h"
+#include "utils/bitutils.h"
 #include "utils/log.h"
 
 Processor
@@ -18,6 +20,79 @@ gProcessor { coreinit::CoreCount };
 static thread_local Core *
 tCurrentCore = nullptr;
 
+// Idle loop iterations before the core is released, how long it sleeps
+//   when there is nothing else to run, and the gap which ends a spin.
+static const uint32_t IdleSpinCount = 1000;
+static const auto IdleWaitTime = std::chrono::microseconds { 500 };
+static const auto IdleResetTime = std::chrono::milliseconds { 1 };
+
+// Guest clock reads closer together than this are a busy wait
+static const auto TimePollInterval = std::chrono::microseconds { 5 };
+
+// Fibers of exited threads kept for reuse, any more are freed
+static const size_t MaxPooledFibers = 32;
+
+// Virtual time starts at a fixed date and runs at one instruction per
+//   cycle of the 1.243125GHz Espresso.
+static const auto VirtualStartTime = std::chrono::system_clock::from_time_t(1451606400);
+static const uint64_t VirtualTicksPerMs = 1243125;
+
+static std::chrono::nanoseconds
+toVirtualDuration(uint64_t ticks)
+{
+   auto ns = (ticks / VirtualTicksPerMs) * 1000000 + (ticks % VirtualTicksPerMs) * 1000000 / VirtualTicksPerMs;
+   return std::chrono::nanoseconds { ns };
+}
+
+static uint64_t
+toVirtualTicks(std::chrono::system_clock::time_point time)
+{
+   if (time == std::chrono::system_clock::time_point::max()) {
+      return UINT64_MAX;
+   }
+
+   if (time <= VirtualStartTime) {
+      return 0;
+   }
+
+   uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(time - VirtualStartTime).count();
+   return (ns / 1000000) * VirtualTicksPerMs + (ns % 1000000) * VirtualTicksPerMs / 1000000;
+}
+
+// Clock used to spot spinning threads, in virtual time mode it must only
+//   depend on what the core has run to keep the guest timeline the same.
+static std::chrono::steady_clock::time_point
+getCoreClock(Core *core)
+{
+   if (cpu::isVirtualTime()) {
+      auto ticks = core->state.virtualTime.load(std::memory_order_relaxed);
+      auto duration = std::chrono::duration_cast<std::chrono::steady_clock::duration>(toVirtualDuration(ticks));
+      return std::chrono::steady_clock::time_point { duration };
+   }
+
+   return std::chrono::steady_clock::now();
+}
+
+// In virtual time mode a core with nothing to run jumps ahead to its next
+//   interrupt, returns false if it has none.
+static bool
+skipToDeadline(Core *core)
+{
+   auto deadline = core->state.virtualDeadline.load(std::memory_order_relaxed);
+
+   if (deadline == UINT64_MAX) {
+      return false;
+   }
+
+   if (core->state.virtualTime.load(std::memory_order_relaxed) < deadline) {
+      core->state.virtualTime.store(deadline, std::memory_order_relaxed);
+   }
+
+   // Raises the interrupt now the deadline has been reached
+   cpu::setVirtualDeadline(&core->state, deadline);
+   return true;
+}
+
 Processor::Processor(size_t cores)
 {
    for (auto i = 0u; i < cores; ++i) {
@@ -35,6 +110,7 @@ Processor::start()
    mRunning = true;
 
    cpu::set_interrupt_handler(handleInterrupt);
+   cpu::set_idle_handler(handleIdle);
 
    for (auto core : mCores) {
       core->thread = std::thread(std::bind(&Processor::coreEntryPoint, this, core));
@@ -74,6 +150,9 @@ Processor::stop()
 
    mTimerCondition.notify_all();
    mTimerThread.join();
+
+   auto stats = getFiberPoolStats();
+   gLog->debug("Fiber pool: {} created, {} reused, {} pooled", stats.created, stats.reused, stats.pooled);
 }
 
 
@@ -122,10 +201,10 @@ Processor::coreEntryPoint(Core *core)
 
       std::unique_lock<std::mutex> lock { mMutex };
 
-      // Cleanup pending delete fibers
+      // Recycle fibers of exited threads
       for (auto fiber : core->fiberDeleteList) {
          mFiberList.erase(std::remove(mFiberList.begin(), mFiberList.end(), fiber), mFiberList.end());
-         delete fiber;
+         releaseFiberNoLock(fiber);
       }
 
       core->fiberDeleteList.clear();
@@ -145,10 +224,7 @@ Processor::coreEntryPoint(Core *core)
          queueNoLock(core->interruptHandlerFiber);
       }
 
-      if (auto fiber = peekNextFiberNoLock(core->id)) {
-         // Remove fiber from schedule queue
-         mFiberQueue.erase(std::remove(mFiberQueue.begin(), mFiberQueue.end(), fiber), mFiberQueue.end());
-
+      if (auto fiber = takeNextFiber(core->id)) {
          // Switch to fiber
          core->currentFiber = fiber;
          core->threadId = fiber->thread->id;
@@ -159,6 +235,9 @@ Processor::coreEntryPoint(Core *core)
          gLog->trace("Core {} enter thread {}", core->id, fiber->thread->id);
          platform::swapToFiber(core->primaryFiberHandle, fiber->handle);
          core->threadId = 0;
+      } else if (cpu::isVirtualTime() && skipToDeadline(core)) {
+         // Nothing to run until the next interrupt
+         continue;
       } else {
          // Wait for a valid fiber
          gLog->trace("Core {} wait for thread", core->id);
@@ -177,7 +256,6 @@ Processor::coreEntryPoint(Core *core)
 void
 Processor::reschedule(bool hasSchedulerLock, bool yield)
 {
-   std::unique_lock<std::mutex> lock { mMutex };
    auto core = tCurrentCore;
 
    if (!core) {
@@ -187,23 +265,24 @@ Processor::reschedule(bool hasSchedulerLock, bool yield)
 
    auto fiber = core->currentFiber;
    auto thread = fiber->thread;
-   auto next = peekNextFiberNoLock(core->id);
+   int32_t next = 0;
+   auto hasNext = peekNextPriority(core->id, next);
 
    // Priority is 0 = highest, 31 = lowest
    if (thread->suspendCounter <= 0 && thread->state == OSThreadState::Running) {
-      if (!next) {
+      if (!hasNext) {
          // There is no thread to reschedule to
          return;
       }
 
       if (yield) {
          // Yield will transfer control to threads with equal or better priority
-         if (thread->basePriority < next->thread->basePriority) {
+         if (thread->basePriority < next) {
             return;
          }
       } else {
          // Only reschedule to more important threads
-         if (thread->basePriority <= next->thread->basePriority) {
+         if (thread->basePriority <= next) {
             return;
          }
       }
@@ -224,7 +303,6 @@ Processor::reschedule(bool hasSchedulerLock, bool yield)
    gLog->trace("Core {} leave thread {}", core->id, fiber->thread->id);
 
    // Return to main scheduler fiber
-   lock.unlock();
    platform::swapToFiber(fiber->handle, core->primaryFiberHandle);
 
    // Reacquire scheduler lock if needed
@@ -244,6 +322,108 @@ Processor::yield()
 }
 
 
+void
+Processor::handleIdle(cpu::CoreState *core, ThreadState *state)
+{
+   gProcessor.idle();
+}
+
+
+/**
+ * Called each time the current thread goes around an idle loop.
+ *
+ * Short spins are left alone as they are cheaper than a reschedule. Once a
+ * thread has spun for a while the core switches to another ready thread of
+ * equal or higher priority, or sleeps until a thread is queued, an interrupt
+ * arrives, or a short timeout lets the loop check its condition again.
+ */
+void
+Processor::idle()
+{
+   auto core = tCurrentCore;
+
+   if (!core) {
+      return;
+   }
+
+   auto now = getCoreClock(core);
+
+   if (now - core->lastIdle > IdleResetTime) {
+      core->idleCount = 0;
+   }
+
+   core->lastIdle = now;
+
+   if (++core->idleCount < IdleSpinCount) {
+      return;
+   }
+
+   std::unique_lock<std::mutex> lock { mMutex };
+   auto thread = core->currentFiber->thread;
+   int32_t next = 0;
+
+   if (peekNextPriority(core->id, next) && next <= thread->basePriority) {
+      lock.unlock();
+      yield();
+   } else if (!cpu::hasInterrupt(&core->state)) {
+      if (!cpu::isVirtualTime() || !skipToDeadline(core)) {
+         mCondition.wait_for(lock, IdleWaitTime);
+      }
+   }
+
+   core->lastIdle = getCoreClock(core);
+}
+
+
+/**
+ * Called on guest reads of the clock, a thread reading it back to back
+ * is busy waiting for a time to pass.
+ */
+void
+Processor::pollTime()
+{
+   auto core = tCurrentCore;
+
+   if (!core) {
+      return;
+   }
+
+   auto now = getCoreClock(core);
+   auto busy = now - core->lastTimePoll < TimePollInterval;
+   core->lastTimePoll = now;
+
+   if (busy) {
+      idle();
+   }
+}
+
+
+/**
+ * The guest clock, in virtual time mode it is the clock of the current core
+ * and host threads see the core which is furthest ahead.
+ */
+std::chrono::system_clock::time_point
+Processor::getGuestTime()
+{
+   if (!cpu::isVirtualTime()) {
+      return cpu::getHostTime();
+   }
+
+   uint64_t ticks = 0;
+
+   if (tCurrentCore) {
+      ticks = tCurrentCore->state.virtualTime.load(std::memory_order_relaxed);
+   } else {
+      for (auto core : mCores) {
+         ticks = std::max<uint64_t>(ticks, core->state.virtualTime.load(std::memory_order_relaxed));
+      }
+   }
+
+   auto time = VirtualStartTime + toVirtualDuration(ticks);
+   return std::chrono::time_point_cast<std::chrono::system_clock::duration>(time);
+}
+
+
 /**
  * Exit current thread
  */
@@ -254,6 +434,9 @@ Processor::exit()
    auto fiber = core->currentFiber;
    auto id = fiber->thread->id;
 
+   // The thread may be exiting from a kernel call made by JIT code
+   cpu::jit::releaseThread(&fiber->state);
+
    // Put fiber on pending delete list
    core->fiberDeleteList.push_back(fiber);
 
@@ -269,28 +452,124 @@ Processor::exit()
 void
 Processor::queue(Fiber *fiber)
 {
+   insertFiber(fiber);
+
+   // Taking the lock orders this with a core checking the run queues
+   //   before it waits, so the wakeup can not be missed.
    std::unique_lock<std::mutex> lock { mMutex };
-   queueNoLock(fiber);
+   mCondition.notify_all();
 }
 
 
 void
 Processor::queueNoLock(Fiber *fiber)
 {
-   auto compare =
-      [](Fiber *lhs, Fiber *rhs) {
-         return lhs->thread->basePriority < rhs->thread->basePriority;
-      };
+   insertFiber(fiber);
+   mCondition.notify_all();
+}
+
+
+/**
+ * Add a fiber to the run queue of the core it last ran on, or the first
+ * core its affinity allows. Other cores its affinity allows take it from
+ * there when they have nothing more important to run.
+ */
+void
+Processor::insertFiber(Fiber *fiber)
+{
+   auto thread = fiber->thread;
+   auto attr = static_cast<uint32_t>(thread->attr) & OSThreadAttributes::AffinityAny;
+   auto coreId = fiber->coreID;
+   unsigned long firstCore;
+
+   if (!(attr & (1 << coreId)) && bit_scan_forward(&firstCore, attr)) {
+      coreId = static_cast<uint32_t>(firstCore);
+   }
+
+   auto level = std::max<int32_t>(thread->basePriority - RunQueue::MinPriority, 0);
+   level = std::min<int32_t>(level, RunQueue::LevelCount - 1);
+   auto &queue = mCores[coreId]->runQueue;
+   std::lock_guard<std::mutex> lock { queue.mutex };
+
+   if (fiber->runQueue) {
+      // Already waiting to run
+      return;
+   }
 
    if (tCurrentCore) {
-      gLog->trace("Core {} queued thread {}", tCurrentCore->id, fiber->thread->id);
+      gLog->trace("Core {} queued thread {}", tCurrentCore->id, thread->id);
    } else {
-      gLog->trace("System queued thread {}", fiber->thread->id);
+      gLog->trace("System queued thread {}", thread->id);
    }
 
-   auto pos = std::upper_bound(mFiberQueue.begin(), mFiberQueue.end(), fiber, compare);
-   mFiberQueue.insert(pos, fiber);
-   mCondition.notify_all();
+   fiber->runQueue = &queue;
+   fiber->queueLevel = level;
+   fiber->queueNext = nullptr;
+   fiber->queuePrev = queue.tail[level];
+
+   if (queue.tail[level]) {
+      queue.tail[level]->queueNext = fiber;
+   } else {
+      queue.head[level] = fiber;
+   }
+
+   queue.tail[level] = fiber;
+   queue.ready |= 1ull << level;
+}
+
+
+static void
+removeFiberNoLock(RunQueue &queue, Fiber *fiber)
+{
+   auto level = fiber->queueLevel;
+
+   if (fiber->queuePrev) {
+      fiber->queuePrev->queueNext = fiber->queueNext;
+   } else {
+      queue.head[level] = fiber->queueNext;
+   }
+
+   if (fiber->queueNext) {
+      fiber->queueNext->queuePrev = fiber->queuePrev;
+   } else {
+      queue.tail[level] = fiber->queuePrev;
+   }
+
+   if (!queue.head[level]) {
+      queue.ready &= ~(1ull << level);
+   }
+
+   fiber->runQueue = nullptr;
+   fiber->queueNext = nullptr;
+   fiber->queuePrev = nullptr;
+}
+
+
+/**
+ * Find the most important fiber in queue which may run on the core bit,
+ * only levels set in mask are searched.
+ */
+static Fiber *
+findFiberNoLock(RunQueue &queue, uint32_t bit, uint64_t mask)
+{
+   auto ready = queue.ready & mask;
+   unsigned long level;
+
+   while (bit_scan_forward(&level, ready)) {
+      for (auto fiber = queue.head[level]; fiber; fiber = fiber->queueNext) {
+         auto thread = fiber->thread;
+
+         if (thread->state == OSThreadState::Ready
+          && thread->suspendCounter <= 0
+          && (thread->attr & bit)) {
+            return fiber;
+         }
+      }
+
+      ready &= ~(1ull << level);
+   }
+
+   return nullptr;
 }
 
 
@@ -302,38 +581,158 @@ Processor::createFiber()
 }
 
 
+/**
+ * Take a fiber from the pool, or create one if it is empty.
+ *
+ * Titles which start a short lived thread per job would otherwise allocate
+ * and free a stack for each one. Returns nullptr if no stack could be
+ * allocated.
+ */
 Fiber *
 Processor::createFiberNoLock()
 {
-   auto fiber = new Fiber();
+   Fiber *fiber = nullptr;
+
+   if (!mFiberPool.empty()) {
+      fiber = mFiberPool.back();
+      mFiberPool.pop_back();
+      mFibersReused++;
+   } else {
+      fiber = new Fiber();
+
+      if (!fiber->handle) {
+         gLog->error("Failed to allocate a fiber stack for a new thread");
+         delete fiber;
+         return nullptr;
+      }
+
+      mFibersCreated++;
+   }
+
    mFiberList.push_back(fiber);
    return fiber;
 }
 
 
 /**
- * Find the next suitable fiber to run on a specified core
+ * Return the fiber of an exited thread to the pool.
+ *
+ * Must not be called on the fiber being released, its stack is restarted.
  */
-Fiber *
-Processor::peekNextFiberNoLock(uint32_t core)
+void
+Processor::releaseFiberNoLock(Fiber *fiber)
 {
-   auto bit = 1 << core;
+   if (mFiberPool.size() >= MaxPooledFibers) {
+      delete fiber;
+      return;
+   }
 
-   for (auto fiber : mFiberQueue) {
-      if (fiber->thread->state != OSThreadState::Ready) {
-         continue;
+   fiber->coreID = 0;
+   fiber->thread = nullptr;
+
+   if (!platform::resetFiber(fiber->handle)) {
+      delete fiber;
+      return;
+   }
+
+   mFiberPool.push_back(fiber);
+}
+
+
+FiberPoolStats
+Processor::getFiberPoolStats()
+{
+   std::lock_guard<std::mutex> lock { mMutex };
+   FiberPoolStats stats;
+   stats.created = mFibersCreated;
+   stats.reused = mFibersReused;
+   stats.pooled = static_cast<uint32_t>(mFiberPool.size());
+   stats.active = static_cast<uint32_t>(mFiberList.size());
+   return stats;
+}
+
+
+/**
+ * Get the priority of the next fiber a core would run, the queues are
+ * locked one at a time so the answer is only a hint.
+ */
+bool
+Processor::peekNextPriority(uint32_t core, int32_t &priority)
+{
+   auto bit = 1u << core;
+   auto mask = ~0ull;
+   auto found = false;
+
+   // Our own queue first, so another core only wins with a better level
+   for (auto i = 0u; i < mCores.size(); ++i) {
+      auto &queue = mCores[(core + i) % mCores.size()]->runQueue;
+      std::lock_guard<std::mutex> lock { queue.mutex };
+
+      if (auto fiber = findFiberNoLock(queue, bit, mask)) {
+         priority = static_cast<int32_t>(fiber->queueLevel) + RunQueue::MinPriority;
+         mask = (1ull << fiber->queueLevel) - 1;
+         found = true;
+      }
+   }
+
+   return found;
+}
+
+
+/**
+ * Remove the next fiber to run on a core from the run queues, taking it
+ * from another core if that one is more important.
+ *
+ * Only one queue is locked at a time, a fiber to steal is looked for
+ * first and then looked for again under its queue's lock before taking it.
+ */
+Fiber *
+Processor::takeNextFiber(uint32_t core)
+{
+   auto bit = 1u << core;
+   auto mask = ~0ull;
+   auto stealMask = 0ull;
+   auto &own = mCores[core]->runQueue;
+   RunQueue *steal = nullptr;
+
+   // Another core's fiber has to beat the best one in our own queue
+   {
+      std::lock_guard<std::mutex> lock { own.mutex };
+
+      if (auto fiber = findFiberNoLock(own, bit, mask)) {
+         mask = (1ull << fiber->queueLevel) - 1;
       }
+   }
 
-      if (fiber->thread->suspendCounter > 0) {
-         continue;
+   for (auto i = 1u; i < mCores.size(); ++i) {
+      auto &queue = mCores[(core + i) % mCores.size()]->runQueue;
+      std::lock_guard<std::mutex> lock { queue.mutex };
+
+      if (auto fiber = findFiberNoLock(queue, bit, mask)) {
+         steal = &queue;
+         stealMask = (1ull << (fiber->queueLevel + 1)) - 1;
+         mask = (1ull << fiber->queueLevel) - 1;
       }
+   }
+
+   if (steal) {
+      std::lock_guard<std::mutex> lock { steal->mutex };
 
-      if (fiber->thread->attr & bit) {
+      if (auto fiber = findFiberNoLock(*steal, bit, stealMask)) {
+         removeFiberNoLock(*steal, fiber);
          return fiber;
       }
    }
 
-   return nullptr;
+   // Nothing better elsewhere, or it was taken by its own core meanwhile
+   std::lock_guard<std::mutex> lock { own.mutex };
+   auto next = findFiberNoLock(own, bit, ~0ull);
+
+   if (next) {
+      removeFiberNoLock(own, next);
+   }
+
+   return next;
 }
 
 
@@ -385,7 +784,7 @@ Processor::timerEntryPoint()
 {
    while (mRunning) {
       std::unique_lock<std::mutex> lock { mTimerMutex };
-      auto now = std::chrono::system_clock::now();
+      auto now = cpu::getHostTime();
       auto next = std::chrono::time_point<std::chrono::system_clock>::max();
       bool timedWait = false;
 
@@ -402,7 +801,8 @@ Processor::timerEntryPoint()
       }
 
       if (timedWait) {
-         mTimerCondition.wait_until(lock, next);
+         // Relative wait, the guest clock may drift from system_clock
+         mTimerCondition.wait_for(lock, next - now);
       } else {
          mTimerCondition.wait(lock);
       }
@@ -484,6 +884,18 @@ Processor::setInterruptTimer(uint32_t core, std::chrono::time_point<std::chrono:
 {
    std::unique_lock<std::mutex> lock { mTimerMutex };
 
+   // The core raises its own interrupt when it reaches the deadline
+   if (cpu::isVirtualTime()) {
+      auto &state = mCores[core]->state;
+      auto deadline = toVirtualTicks(when);
+
+      if (deadline < state.virtualDeadline.load()) {
+         cpu::setVirtualDeadline(&state, deadline);
+      }
+
+      return;
+   }
+
    if (when < mCores[core]->nextInterrupt) {
       mCores[core]->nextInterrupt = when;
    }
@@ -1,6 +1,7 @@
 #pragma once
 #include <atomic>
 #include <algorithm>
+#include <chrono>
 #include <condition_variable>
 #include <mutex>
 #include <thread>
@@ -15,6 +16,8 @@ struct OSContext;
 struct OSThread;
 }
 
+struct RunQueue;
+
 
 /**
  * Per Wii U thread data
@@ -28,7 +31,9 @@ struct Fiber
 
    ~Fiber()
    {
-      platform::destroyFiber(handle);
+      if (handle) {
+         platform::destroyFiber(handle);
+      }
    }
 
    static void fiberEntryPoint(void *param);
@@ -37,6 +42,43 @@ struct Fiber
    platform::Fiber *handle = nullptr;
    coreinit::OSThread *thread = nullptr;
    ThreadState state;
+
+   // Links in the run queue of the core this fiber is waiting on
+   RunQueue *runQueue = nullptr;
+   Fiber *queueNext = nullptr;
+   Fiber *queuePrev = nullptr;
+   uint32_t queueLevel = 0;
+};
+
+
+/**
+ * Fibers ready to run on a core.
+ *
+ * There is a list per priority level and a mask of the levels with fibers,
+ * so the most important one is found with a single bit scan. Kernel threads
+ * run at priorities below 0, which is why there are more than 32 levels.
+ */
+struct RunQueue
+{
+   static const int32_t MinPriority = -2;
+   static const uint32_t LevelCount = 34;
+
+   std::mutex mutex;
+   uint64_t ready = 0;
+   Fiber *head[LevelCount] = { };
+   Fiber *tail[LevelCount] = { };
+};
+
+
+/**
+ * Fiber pool occupancy, see Processor::createFiber
+ */
+struct FiberPoolStats
+{
+   uint32_t created;    // Fibers allocated with a new stack
+   uint32_t reused;     // Fibers taken from the pool
+   uint32_t pooled;     // Fibers waiting in the pool
+   uint32_t active;     // Fibers belonging to a thread
 };
 
 
@@ -61,7 +103,13 @@ struct Core
    std::chrono::system_clock::time_point nextInterrupt;
    std::vector<Fiber *> fiberDeleteList;
    std::vector<Fiber *> fiberPendingList;
+   RunQueue runQueue;
    cpu::CoreState state;
+
+   // Idle loop detection, see Processor::idle
+   uint32_t idleCount = 0;
+   std::chrono::steady_clock::time_point lastIdle;
+   std::chrono::steady_clock::time_point lastTimePoll;
 };
 
 
@@ -107,6 +155,20 @@ public:
    Fiber *
    getCurrentFiber();
 
+   FiberPoolStats
+   getFiberPoolStats();
+
+   // Time
+   std::chrono::system_clock::time_point
+   getGuestTime();
+
+   // Idle
+   void
+   idle();
+
+   void
+   pollTime();
+
    // Interrupts
    void
    handleInterrupt();
@@ -162,11 +224,23 @@ protected:
    static void
    handleInterrupt(cpu::CoreState *core, ThreadState *state);
 
+   static void
+   handleIdle(cpu::CoreState *core, ThreadState *state);
+
    Fiber *
    createFiberNoLock();
 
+   void
+   releaseFiberNoLock(Fiber *fiber);
+
+   bool
+   peekNextPriority(uint32_t core, int32_t &priority);
+
    Fiber *
-   peekNextFiberNoLock(uint32_t core);
+   takeNextFiber(uint32_t core);
+
+   void
+   insertFiber(Fiber *fiber);
 
    void
    queueNoLock(Fiber *fiber);
@@ -176,8 +250,10 @@ private:
    std::vector<Core*> mCores;
    std::mutex mMutex;
    std::condition_variable mCondition;
-   std::vector<Fiber *> mFiberQueue;
    std::vector<Fiber *> mFiberList;
+   std::vector<Fiber *> mFiberPool;
+   uint32_t mFibersCreated = 0;
+   uint32_t mFibersReused = 0;
    std::thread mTimerThread;
    std::mutex mTimerMutex;
    std::condition_variable mTimerCondition;
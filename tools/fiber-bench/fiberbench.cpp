@@ -0,0 +1,82 @@
+// Measures the cost of switching between two fibers with platform::swapToFiber
+//   and with the swapcontext it used to be built on.
+//
+// g++ -O2 -std=c++14 -I../../src fiberbench.cpp ../../src/platform/platform_posix_fiber.cpp -o fiberbench
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <ucontext.h>
+#include "platform/platform_fiber.h"
+
+static const size_t StackSize = 1024 * 1024;
+
+static unsigned sIterations = 1000000;
+
+static platform::Fiber *sMainFiber;
+static platform::Fiber *sWorkerFiber;
+
+static ucontext_t sMainContext;
+static ucontext_t sWorkerContext;
+
+static void
+fiberWorker(void *)
+{
+   while (true) {
+      platform::swapToFiber(sWorkerFiber, sMainFiber);
+   }
+}
+
+static void
+contextWorker()
+{
+   while (true) {
+      swapcontext(&sWorkerContext, &sMainContext);
+   }
+}
+
+template<typename Fn>
+static double
+measure(Fn fn)
+{
+   auto start = std::chrono::steady_clock::now();
+
+   for (auto i = 0u; i < sIterations; ++i) {
+      fn();
+   }
+
+   auto end = std::chrono::steady_clock::now();
+   auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+
+   // Every iteration switches there and back again
+   return static_cast<double>(ns) / (sIterations * 2.0);
+}
+
+int main(int argc, char **argv)
+{
+   if (argc > 1) {
+      sIterations = static_cast<unsigned>(std::strtoul(argv[1], nullptr, 0));
+   }
+
+   sMainFiber = platform::getThreadFiber();
+   sWorkerFiber = platform::createFiber(fiberWorker, nullptr);
+
+   auto fiberTime = measure([]() {
+      platform::swapToFiber(sMainFiber, sWorkerFiber);
+   });
+
+   auto stack = new char[StackSize];
+   getcontext(&sWorkerContext);
+   sWorkerContext.uc_stack.ss_sp = stack;
+   sWorkerContext.uc_stack.ss_size = StackSize;
+   sWorkerContext.uc_link = nullptr;
+   makecontext(&sWorkerContext, contextWorker, 0);
+
+   auto contextTime = measure([]() {
+      swapcontext(&sMainContext, &sWorkerContext);
+   });
+
+   std::printf("%u round trips\n", sIterations);
+   std::printf("platform::swapToFiber %8.1f ns per switch\n", fiberTime);
+   std::printf("swapcontext           %8.1f ns per switch\n", contextTime);
+   return 0;
+}